@@ -1,5 +1,6 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <string>
 #include <cstring>
@@ -7,13 +8,47 @@
 #include <cstdint>
 #include <iomanip>
 #include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <csignal>
+#include <cmath>
+#include <random>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <omp.h>      // OpenMP Header
 #include <zstd.h>     // Zstandard Header
+#ifdef __SSE2__
+#include <emmintrin.h> // Non-temporal stores
+#endif
 
 // --- Configuration ---
 constexpr size_t CHUNK_SIZE = 32 * 1024 * 1024; // 32MB per chunk
-constexpr int BATCH_SIZE = 8;                   // Process 8 chunks at a time (approx 256MB RAM usage)
+constexpr int BATCH_SIZE = 8;                   // Decompress 8 chunks at a time (approx 256MB RAM usage)
 constexpr int DEFAULT_COMPRESSION_LEVEL = 3;
+constexpr int BF16_MANTISSA_BITS = 7;           // Keeping all 7 bits is lossless
+constexpr int PROBE_SAMPLES = 4;                // Cost probe: samples per chunk
+constexpr size_t PROBE_SAMPLE_SIZE = 16 * 1024; // Cost probe: bytes per sample
+constexpr uint64_t PACK_TENSOR_LIMIT = 256 * 1024;    // Packing: smaller tensors share frames
+constexpr uint64_t PACK_FRAME_SIZE = 1024 * 1024;     // Packing: target size of a shared frame
 
 // --- Helper Utilities ---
 class Timer {
@@ -26,7 +61,7 @@ public:
     }
 };
 
-uint64_t get_file_size(std::ifstream& file) {
+uint64_t get_file_size(std::istream& file) {
     std::streampos current = file.tellg();
     file.seekg(0, std::ios::end);
     std::streampos end = file.tellg();
@@ -50,244 +85,4403 @@ void print_progress(uint64_t processed, uint64_t total) {
     std::cout << "] " << int(progress * 100.0) << "% " << std::flush;
 }
 
+// Discards everything written to it; one per thread, so format flags set on it
+// never race
+std::ostream& null_stream() {
+    thread_local std::ostream null(nullptr);
+    return null;
+}
+
 // --- Binary I/O Helpers ---
 void write_uint64(std::ofstream& out, uint64_t value) {
     out.write(reinterpret_cast<const char*>(&value), sizeof(value));
 }
 
-bool read_uint64(std::ifstream& in, uint64_t& value) {
-    in.read(reinterpret_cast<char*>(&value), sizeof(value));
-    return in.gcount() == sizeof(value);
-}
+bool read_uint64(std::istream& in, uint64_t& value) {
+    in.read(reinterpret_cast<char*>(&value), sizeof(value));
+    return in.gcount() == sizeof(value);
+}
+
+// Positioned read of exactly n bytes; safe to call from many threads on one descriptor
+void pread_exact(int fd, void* dst, size_t n, uint64_t pos) {
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    while (n > 0) {
+        ssize_t got = ::pread(fd, out, n, static_cast<off_t>(pos));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) throw std::runtime_error("Truncated compressed data");
+        out += got;
+        pos += got;
+        n -= got;
+    }
+}
+
+// --- Throttled Storage (benchmarking) ---
+// Emulates a slow device (network filesystem, HDD tier) so the overlap of I/O
+// and compression can be tuned on any machine. Every request pays a fixed
+// latency and draws its size from a token bucket refilled at the configured
+// bandwidth; reads and writes share the same bucket like they share a device.
+struct ThrottleOptions {
+    double bandwidth_mbps = 0.0; // MB/s, 0 = unlimited
+    double latency_ms = 0.0;     // Per request
+    double burst_mb = 4.0;       // Bucket capacity
+    bool in_memory = false;      // Serve the input from RAM so the real disk is out of the picture
+
+    bool enabled() const { return bandwidth_mbps > 0.0 || latency_ms > 0.0 || in_memory; }
+};
+
+class TokenBucket {
+    using Clock = std::chrono::steady_clock;
+    double rate;      // Bytes per second
+    double capacity;
+    double latency;   // Seconds
+    double tokens;
+    Clock::time_point last;
+    std::mutex lock;
+public:
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> stalled_us{0};
+
+    explicit TokenBucket(const ThrottleOptions& opts)
+        : rate(opts.bandwidth_mbps * 1e6), capacity(opts.burst_mb * 1e6), latency(opts.latency_ms / 1e3),
+          tokens(opts.burst_mb * 1e6), last(Clock::now()) {}
+
+    // Blocks the caller for as long as the emulated device needs to move n bytes
+    void acquire(uint64_t n) {
+        double wait = latency;
+        if (rate > 0.0) {
+            std::lock_guard<std::mutex> guard(lock);
+            Clock::time_point now = Clock::now();
+            tokens = std::min(capacity, tokens + std::chrono::duration<double>(now - last).count() * rate);
+            last = now;
+            tokens -= static_cast<double>(n); // May go negative: later requests queue behind this one
+            if (tokens < 0.0) wait += -tokens / rate;
+        }
+        requests++;
+        bytes += n;
+        if (wait > 0.0) {
+            stalled_us += static_cast<uint64_t>(wait * 1e6);
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        }
+    }
+
+    void report(const char* what, std::ostream& os = std::cout) const {
+        os << "Throttled " << what << ": " << requests << " requests, " << bytes / 1e6 << " MB, "
+                  << stalled_us / 1e6 << "s stalled" << std::endl;
+    }
+};
+
+// Read-only stream buffer over a file (or an in-memory copy of it) whose device
+// reads go through a TokenBucket. Small reads are served from a read-ahead buffer.
+class ThrottledStreamBuf : public std::streambuf {
+    static constexpr size_t READ_AHEAD = 64 * 1024;
+    std::ifstream file;
+    std::vector<char> memory;
+    bool in_memory;
+    uint64_t size = 0;
+    uint64_t device_pos = 0; // Next byte the device will return
+    std::vector<char> buffer;
+    TokenBucket* bucket;
+
+    std::streamsize fetch(char* dst, std::streamsize n) {
+        n = std::min<std::streamsize>(n, size - std::min(size, device_pos));
+        if (n <= 0) return 0;
+        if (bucket) bucket->acquire(n);
+        if (in_memory) {
+            std::memcpy(dst, memory.data() + device_pos, n);
+        } else {
+            file.seekg(device_pos, std::ios::beg);
+            file.read(dst, n);
+            n = file.gcount();
+        }
+        device_pos += n;
+        return n;
+    }
+
+public:
+    ThrottledStreamBuf(const std::string& path, bool load_in_memory, TokenBucket* throttle)
+        : file(path, std::ios::binary), in_memory(load_in_memory), buffer(READ_AHEAD), bucket(throttle) {
+        if (!file) throw std::runtime_error("Cannot open input: " + path);
+        file.seekg(0, std::ios::end);
+        size = static_cast<uint64_t>(file.tellg());
+        file.seekg(0, std::ios::beg);
+        if (in_memory) {
+            memory.resize(size);
+            file.read(memory.data(), size);
+            file.close();
+        }
+        setg(buffer.data(), buffer.data(), buffer.data());
+    }
+
+protected:
+    int_type underflow() override {
+        std::streamsize n = fetch(buffer.data(), buffer.size());
+        setg(buffer.data(), buffer.data(), buffer.data() + n);
+        return n > 0 ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+    }
+
+    std::streamsize xsgetn(char* dst, std::streamsize n) override {
+        std::streamsize done = std::min<std::streamsize>(n, egptr() - gptr());
+        std::memcpy(dst, gptr(), done);
+        gbump(static_cast<int>(done));
+        // Large reads (whole chunks) go to the device in one request
+        if (done < n && n - done >= static_cast<std::streamsize>(READ_AHEAD)) return done + fetch(dst + done, n - done);
+        while (done < n && underflow() != traits_type::eof()) {
+            std::streamsize part = std::min<std::streamsize>(n - done, egptr() - gptr());
+            std::memcpy(dst + done, gptr(), part);
+            gbump(static_cast<int>(part));
+            done += part;
+        }
+        return done;
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        uint64_t current = device_pos - (egptr() - gptr());
+        if (dir == std::ios_base::cur) return seekpos(current + off, which);
+        if (dir == std::ios_base::end) return seekpos(size + off, which);
+        return seekpos(off, which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode) override {
+        uint64_t target = static_cast<uint64_t>(pos);
+        uint64_t buffered_start = device_pos - (egptr() - eback());
+        if (target >= buffered_start && target <= device_pos) {
+            setg(eback(), eback() + (target - buffered_start), egptr());
+        } else {
+            device_pos = target;
+            setg(buffer.data(), buffer.data(), buffer.data());
+        }
+        return pos;
+    }
+};
+
+class ThrottledInput : public std::istream {
+    ThrottledStreamBuf buf;
+public:
+    ThrottledInput(const std::string& path, bool in_memory, TokenBucket* bucket)
+        : std::istream(nullptr), buf(path, in_memory, bucket) {
+        rdbuf(&buf);
+    }
+};
+
+std::unique_ptr<std::istream> open_input(const std::string& path, const ThrottleOptions& throttle, TokenBucket* bucket) {
+    if (!throttle.enabled()) return std::unique_ptr<std::istream>(new std::ifstream(path, std::ios::binary));
+    return std::unique_ptr<std::istream>(new ThrottledInput(path, throttle.in_memory, bucket));
+}
+
+// In-memory serialization used for the container footer
+class ByteWriter {
+    std::vector<uint8_t> buf;
+public:
+    void put_u8(uint8_t v) { buf.push_back(v); }
+    void put_u32(uint32_t v) { put_raw(&v, sizeof(v)); }
+    void put_u64(uint64_t v) { put_raw(&v, sizeof(v)); }
+    void put_f64(double v) { put_raw(&v, sizeof(v)); }
+    void put_str(const std::string& s) { put_u64(s.size()); put_raw(s.data(), s.size()); }
+    void put_raw(const void* p, size_t n) {
+        const uint8_t* b = static_cast<const uint8_t*>(p);
+        buf.insert(buf.end(), b, b + n);
+    }
+    const std::vector<uint8_t>& data() const { return buf; }
+};
+
+class ByteReader {
+    const uint8_t* p;
+    const uint8_t* end;
+public:
+    ByteReader(const uint8_t* data, size_t size) : p(data), end(data + size) {}
+    void get_raw(void* dst, size_t n) {
+        if (static_cast<size_t>(end - p) < n) throw std::runtime_error("Corrupted footer");
+        std::memcpy(dst, p, n);
+        p += n;
+    }
+    uint8_t get_u8() { uint8_t v; get_raw(&v, sizeof(v)); return v; }
+    uint32_t get_u32() { uint32_t v; get_raw(&v, sizeof(v)); return v; }
+    uint64_t get_u64() { uint64_t v; get_raw(&v, sizeof(v)); return v; }
+    double get_f64() { double v; get_raw(&v, sizeof(v)); return v; }
+    std::string get_str() {
+        uint64_t n = get_u64();
+        if (static_cast<uint64_t>(end - p) < n) throw std::runtime_error("Corrupted footer");
+        std::string s(reinterpret_cast<const char*>(p), n);
+        p += n;
+        return s;
+    }
+    const uint8_t* position() const { return p; }
+    uint64_t remaining() const { return static_cast<uint64_t>(end - p); }
+    ByteReader sub(uint64_t n) {
+        if (static_cast<uint64_t>(end - p) < n) throw std::runtime_error("Corrupted footer");
+        ByteReader r(p, n);
+        p += n;
+        return r;
+    }
+    bool empty() const { return p == end; }
+};
+
+// --- Container Footer ---
+// The chunk stream keeps the original layout:
+//   [u64 header_size][header][u64 raw_size][u64 comp_size][frame]...
+// Optional features append a footer of tagged sections after the last chunk:
+//   [u64 tag][u64 length][payload]... [u64 footer_size][u64 FOOTER_MAGIC]
+// Archives without the trailing magic are plain chunk streams.
+// The serial decompressor (main.cpp) follows the chunk index and refuses any
+// section that changes what a frame holds, so keep new frame formats behind a
+// new section.
+constexpr uint64_t FOOTER_MAGIC = 0x5846363142465A31ULL; // "1ZFB16FX"
+
+enum FooterSection : uint64_t {
+    SECTION_LOSSY = 1,      // Mantissa rounding parameters and measured error
+    SECTION_CHUNK_BITS = 2, // Packed low-plane width of every chunk
+    SECTION_ROW_PERM = 3,   // Rows of 2D BF16 tensors are permuted, keys stored in-frame
+    SECTION_CHUNK_INDEX = 4,// File position of every logical chunk
+    SECTION_CHUNK_HASH = 5, // Input hash of every logical chunk, for incremental recompression
+    SECTION_MANTISSA = 6,   // Progressive layout: mantissa frames stored after all exponent frames
+    SECTION_PACKED = 7,     // Small tensors gathered into shared frames, with their place in each frame
+    SECTION_SOURCE = 8      // Input was not safetensors; the stored header only describes it
+};
+
+enum SourceFormat : uint32_t {
+    SOURCE_SAFETENSORS = 0,
+    SOURCE_PYTORCH_ZIP = 1  // Restored as the zip itself, without the stored header in front
+};
+
+// Chunks may be written in any order; the index maps logical chunks to records
+struct ChunkIndexEntry {
+    uint64_t file_offset = 0; // Start of the [raw_size][comp_size][frame] record
+    uint64_t data_offset = 0; // Position in the stored tensor data region
+    uint64_t raw_size = 0;
+    uint64_t comp_size = 0;
+};
+
+// A run of the data region stored inside one decoded chunk. Packed chunks gather
+// several of them, so their index entry alone does not say where the bytes go.
+struct ChunkSegment {
+    uint64_t data_offset = 0;
+    uint64_t size = 0;
+    uint64_t chunk = 0;
+    uint64_t frame_offset = 0; // Position inside the decoded chunk
+};
+
+struct TensorRounding {
+    std::string name;
+    uint32_t mantissa_bits = BF16_MANTISSA_BITS;
+    double max_abs_error = 0.0;
+    double sum_abs_error = 0.0;
+    uint64_t elements = 0;
+};
+
+struct Footer {
+    bool lossy = false;
+    uint32_t default_mantissa_bits = BF16_MANTISSA_BITS;
+    double relative_error_bound = 0.0;
+    std::vector<TensorRounding> rounded;
+    std::vector<uint8_t> chunk_low_bits;
+    bool rows_permuted = false;
+    std::vector<ChunkIndexEntry> index;
+    uint64_t settings_hash = 0;        // Options that shape the frames, including the level
+    std::vector<uint64_t> chunk_hashes;
+    std::vector<ChunkIndexEntry> mantissa_index; // Progressive: raw_size is the packed mantissa size
+    std::vector<ChunkSegment> packed;  // Segments of packed chunks; other chunks are contiguous
+    uint32_t source_format = SOURCE_SAFETENSORS;
+    std::vector<uint8_t> source_tail;  // Odd last byte of the input, which cannot be shuffled
+
+    bool progressive() const { return !mantissa_index.empty(); }
+};
+
+void write_section(ByteWriter& out, uint64_t tag, const ByteWriter& payload) {
+    out.put_u64(tag);
+    out.put_u64(payload.data().size());
+    out.put_raw(payload.data().data(), payload.data().size());
+}
+
+// Encodes the sections followed by the [footer_size][FOOTER_MAGIC] trailer
+std::vector<uint8_t> encode_footer(const Footer& footer) {
+    ByteWriter body;
+    if (footer.lossy) {
+        ByteWriter s;
+        s.put_u32(footer.default_mantissa_bits);
+        s.put_f64(footer.relative_error_bound);
+        s.put_u64(footer.rounded.size());
+        for (const auto& t : footer.rounded) {
+            s.put_str(t.name);
+            s.put_u32(t.mantissa_bits);
+            s.put_f64(t.max_abs_error);
+            s.put_f64(t.elements ? t.sum_abs_error / t.elements : 0.0);
+        }
+        write_section(body, SECTION_LOSSY, s);
+    }
+    if (!footer.chunk_low_bits.empty()) {
+        ByteWriter s;
+        s.put_u64(footer.chunk_low_bits.size());
+        s.put_raw(footer.chunk_low_bits.data(), footer.chunk_low_bits.size());
+        write_section(body, SECTION_CHUNK_BITS, s);
+    }
+    if (footer.rows_permuted) {
+        ByteWriter s;
+        s.put_u32(1); // Key: max exponent per row, stable ascending order
+        write_section(body, SECTION_ROW_PERM, s);
+    }
+    if (!footer.index.empty()) {
+        ByteWriter s;
+        s.put_u64(footer.index.size());
+        for (const auto& e : footer.index) {
+            s.put_u64(e.file_offset);
+            s.put_u64(e.data_offset);
+            s.put_u64(e.raw_size);
+            s.put_u64(e.comp_size);
+        }
+        write_section(body, SECTION_CHUNK_INDEX, s);
+    }
+    if (!footer.chunk_hashes.empty()) {
+        ByteWriter s;
+        s.put_u64(footer.settings_hash);
+        s.put_u64(footer.chunk_hashes.size());
+        for (uint64_t h : footer.chunk_hashes) s.put_u64(h);
+        write_section(body, SECTION_CHUNK_HASH, s);
+    }
+    if (footer.progressive()) {
+        ByteWriter s;
+        s.put_u64(footer.mantissa_index.size());
+        for (const auto& e : footer.mantissa_index) {
+            s.put_u64(e.file_offset);
+            s.put_u64(e.raw_size);
+            s.put_u64(e.comp_size);
+        }
+        write_section(body, SECTION_MANTISSA, s);
+    }
+    if (!footer.packed.empty()) {
+        ByteWriter s;
+        s.put_u64(footer.packed.size());
+        for (const auto& seg : footer.packed) {
+            s.put_u64(seg.chunk);
+            s.put_u64(seg.data_offset);
+            s.put_u64(seg.size);
+            s.put_u64(seg.frame_offset);
+        }
+        write_section(body, SECTION_PACKED, s);
+    }
+    if (footer.source_format != SOURCE_SAFETENSORS) {
+        ByteWriter s;
+        s.put_u32(footer.source_format);
+        s.put_u64(footer.source_tail.size());
+        s.put_raw(footer.source_tail.data(), footer.source_tail.size());
+        write_section(body, SECTION_SOURCE, s);
+    }
+
+    uint64_t body_size = body.data().size();
+    body.put_u64(body_size);
+    body.put_u64(FOOTER_MAGIC);
+    return body.data();
+}
+
+uint64_t write_footer(std::ofstream& out, const Footer& footer) {
+    std::vector<uint8_t> bytes = encode_footer(footer);
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    return bytes.size();
+}
+
+// Reads the footer if present and returns the file offset where the chunk stream ends.
+uint64_t read_footer(std::istream& in, uint64_t file_size, Footer& footer) {
+    if (file_size < 2 * sizeof(uint64_t)) return file_size;
+    std::streampos current = in.tellg();
+    uint64_t footer_size = 0, magic = 0;
+    in.seekg(file_size - 2 * sizeof(uint64_t), std::ios::beg);
+    if (!read_uint64(in, footer_size) || !read_uint64(in, magic) || magic != FOOTER_MAGIC) {
+        in.clear();
+        in.seekg(current, std::ios::beg);
+        return file_size;
+    }
+    if (footer_size > file_size - 2 * sizeof(uint64_t)) throw std::runtime_error("Corrupted footer");
+
+    uint64_t footer_start = file_size - 2 * sizeof(uint64_t) - footer_size;
+    std::vector<uint8_t> bytes(footer_size);
+    in.seekg(footer_start, std::ios::beg);
+    in.read(reinterpret_cast<char*>(bytes.data()), footer_size);
+    if (in.gcount() != static_cast<std::streamsize>(footer_size)) throw std::runtime_error("Truncated footer");
+    in.seekg(current, std::ios::beg);
+
+    ByteReader r(bytes.data(), bytes.size());
+    while (!r.empty()) {
+        uint64_t tag = r.get_u64();
+        ByteReader s = r.sub(r.get_u64());
+        if (tag == SECTION_LOSSY) {
+            footer.lossy = true;
+            footer.default_mantissa_bits = s.get_u32();
+            footer.relative_error_bound = s.get_f64();
+            footer.rounded.resize(s.get_u64());
+            for (auto& t : footer.rounded) {
+                t.name = s.get_str();
+                t.mantissa_bits = s.get_u32();
+                t.max_abs_error = s.get_f64();
+                t.elements = 1;
+                t.sum_abs_error = s.get_f64();
+            }
+        } else if (tag == SECTION_CHUNK_BITS) {
+            footer.chunk_low_bits.resize(s.get_u64());
+            s.get_raw(footer.chunk_low_bits.data(), footer.chunk_low_bits.size());
+        } else if (tag == SECTION_ROW_PERM) {
+            if (s.get_u32() != 1) throw std::runtime_error("Unsupported row permutation key");
+            footer.rows_permuted = true;
+        } else if (tag == SECTION_CHUNK_INDEX) {
+            footer.index.resize(s.get_u64());
+            for (auto& e : footer.index) {
+                e.file_offset = s.get_u64();
+                e.data_offset = s.get_u64();
+                e.raw_size = s.get_u64();
+                e.comp_size = s.get_u64();
+            }
+        } else if (tag == SECTION_CHUNK_HASH) {
+            footer.settings_hash = s.get_u64();
+            footer.chunk_hashes.resize(s.get_u64());
+            for (auto& h : footer.chunk_hashes) h = s.get_u64();
+        } else if (tag == SECTION_MANTISSA) {
+            footer.mantissa_index.resize(s.get_u64());
+            for (auto& e : footer.mantissa_index) {
+                e.file_offset = s.get_u64();
+                e.raw_size = s.get_u64();
+                e.comp_size = s.get_u64();
+            }
+        } else if (tag == SECTION_PACKED) {
+            footer.packed.resize(s.get_u64());
+            for (auto& seg : footer.packed) {
+                seg.chunk = s.get_u64();
+                seg.data_offset = s.get_u64();
+                seg.size = s.get_u64();
+                seg.frame_offset = s.get_u64();
+            }
+        } else if (tag == SECTION_SOURCE) {
+            footer.source_format = s.get_u32();
+            if (footer.source_format != SOURCE_PYTORCH_ZIP) throw std::runtime_error("Unsupported source format");
+            footer.source_tail.resize(s.get_u64());
+            s.get_raw(footer.source_tail.data(), footer.source_tail.size());
+        }
+        // Unknown sections are skipped for forward compatibility
+    }
+    return footer_start;
+}
+
+// Rebuilds the index of an archive without one by walking its chunk records
+std::vector<ChunkIndexEntry> scan_chunk_stream(std::istream& in, uint64_t start, uint64_t end) {
+    std::vector<ChunkIndexEntry> index;
+    uint64_t pos = start, data_offset = 0;
+    while (pos < end) {
+        ChunkIndexEntry e;
+        in.seekg(pos, std::ios::beg);
+        if (!read_uint64(in, e.raw_size) || !read_uint64(in, e.comp_size)) throw std::runtime_error("Corrupted chunk header");
+        e.file_offset = pos;
+        e.data_offset = data_offset;
+        pos += 2 * sizeof(uint64_t) + e.comp_size;
+        if (pos > end) throw std::runtime_error("Truncated compressed data");
+        data_offset += e.raw_size;
+        index.push_back(e);
+    }
+    in.clear();
+    in.seekg(start, std::ios::beg);
+    return index;
+}
+
+// Where every byte of the data region lives, sorted by data offset: one segment
+// per contiguous chunk plus the recorded segments of packed chunks
+std::vector<ChunkSegment> segment_map(const std::vector<ChunkIndexEntry>& index, const Footer& footer) {
+    std::vector<bool> packed(index.size(), false);
+    std::vector<ChunkSegment> map = footer.packed;
+    for (const auto& seg : footer.packed) {
+        if (seg.chunk >= index.size() || seg.frame_offset + seg.size > index[seg.chunk].raw_size)
+            throw std::runtime_error("Corrupted footer");
+        packed[seg.chunk] = true;
+    }
+    for (size_t i = 0; i < index.size(); ++i)
+        if (!packed[i]) map.push_back({index[i].data_offset, index[i].raw_size, i, 0});
+    std::sort(map.begin(), map.end(),
+              [](const ChunkSegment& a, const ChunkSegment& b) { return a.data_offset < b.data_offset; });
+    return map;
+}
+
+// --- Safetensors Header ---
+struct TensorInfo {
+    std::string name;
+    std::string dtype;
+    std::vector<uint64_t> shape;
+    uint64_t begin = 0; // data_offsets, relative to the first byte after the header
+    uint64_t end = 0;
+    size_t key_order = 0; // Position of the entry in the JSON header
+};
+
+struct SafetensorsHeader {
+    std::vector<TensorInfo> tensors; // Sorted by begin offset
+    std::string metadata;            // Raw JSON of "__metadata__", empty if absent
+};
+
+// Minimal JSON reader, just enough for the safetensors header layout
+class JsonCursor {
+    const char* p;
+    const char* end;
+public:
+    JsonCursor(const char* begin, const char* finish) : p(begin), end(finish) {}
+
+    void skip_ws() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) ++p;
+    }
+    bool peek(char c) { skip_ws(); return p < end && *p == c; }
+    bool consume(char c) {
+        if (!peek(c)) return false;
+        ++p;
+        return true;
+    }
+    void expect(char c) {
+        if (!peek(c)) throw std::runtime_error(std::string("Malformed header: expected '") + c + "'");
+        ++p;
+    }
+    const char* pos() const { return p; }
+
+    std::string parse_string() {
+        expect('"');
+        std::string s;
+        while (p < end && *p != '"') {
+            char c = *p++;
+            if (c != '\\') { s += c; continue; }
+            if (p >= end) break;
+            char e = *p++;
+            switch (e) {
+                case 'b': s += '\b'; break;
+                case 'f': s += '\f'; break;
+                case 'n': s += '\n'; break;
+                case 'r': s += '\r'; break;
+                case 't': s += '\t'; break;
+                case 'u': {
+                    if (end - p < 4) throw std::runtime_error("Malformed header: bad escape");
+                    uint32_t cp = std::stoul(std::string(p, 4), nullptr, 16);
+                    p += 4;
+                    if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                        uint32_t lo = std::stoul(std::string(p + 2, 4), nullptr, 16);
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        p += 6;
+                    }
+                    if (cp < 0x80) s += char(cp);
+                    else if (cp < 0x800) { s += char(0xC0 | (cp >> 6)); s += char(0x80 | (cp & 0x3F)); }
+                    else if (cp < 0x10000) {
+                        s += char(0xE0 | (cp >> 12)); s += char(0x80 | ((cp >> 6) & 0x3F));
+                        s += char(0x80 | (cp & 0x3F));
+                    } else {
+                        s += char(0xF0 | (cp >> 18)); s += char(0x80 | ((cp >> 12) & 0x3F));
+                        s += char(0x80 | ((cp >> 6) & 0x3F)); s += char(0x80 | (cp & 0x3F));
+                    }
+                    break;
+                }
+                default: s += e; break; // \" \\ \/
+            }
+        }
+        if (p >= end) throw std::runtime_error("Malformed header: unterminated string");
+        ++p;
+        return s;
+    }
+
+    uint64_t parse_uint() {
+        skip_ws();
+        if (p >= end || *p < '0' || *p > '9') throw std::runtime_error("Malformed header: expected integer");
+        uint64_t v = 0;
+        while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+        return v;
+    }
+
+    std::vector<uint64_t> parse_uint_array() {
+        std::vector<uint64_t> values;
+        expect('[');
+        if (consume(']')) return values;
+        do { values.push_back(parse_uint()); } while (consume(','));
+        expect(']');
+        return values;
+    }
+
+    void skip_value() {
+        skip_ws();
+        if (p >= end) throw std::runtime_error("Malformed header: unexpected end");
+        if (*p == '"') { parse_string(); return; }
+        if (*p == '{' || *p == '[') {
+            char close = (*p == '{') ? '}' : ']';
+            ++p;
+            if (consume(close)) return;
+            do {
+                if (close == '}') { parse_string(); expect(':'); }
+                skip_value();
+            } while (consume(','));
+            expect(close);
+            return;
+        }
+        while (p < end && *p != ',' && *p != '}' && *p != ']') ++p; // number, true, false, null
+    }
+};
+
+SafetensorsHeader parse_safetensors_header(const std::vector<uint8_t>& header) {
+    const char* text = reinterpret_cast<const char*>(header.data());
+    JsonCursor json(text, text + header.size());
+    SafetensorsHeader result;
+
+    json.expect('{');
+    if (json.consume('}')) return result;
+    do {
+        std::string key = json.parse_string();
+        json.expect(':');
+        if (key == "__metadata__") {
+            json.skip_ws();
+            const char* start = json.pos();
+            json.skip_value();
+            result.metadata.assign(start, json.pos());
+            continue;
+        }
+
+        TensorInfo t;
+        t.name = key;
+        t.key_order = result.tensors.size();
+        json.expect('{');
+        if (!json.peek('}')) do {
+            std::string field = json.parse_string();
+            json.expect(':');
+            if (field == "dtype") t.dtype = json.parse_string();
+            else if (field == "shape") t.shape = json.parse_uint_array();
+            else if (field == "data_offsets") {
+                auto offsets = json.parse_uint_array();
+                if (offsets.size() != 2 || offsets[1] < offsets[0])
+                    throw std::runtime_error("Malformed header: bad data_offsets for " + key);
+                t.begin = offsets[0];
+                t.end = offsets[1];
+            } else json.skip_value();
+        } while (json.consume(','));
+        json.expect('}');
+        result.tensors.push_back(std::move(t));
+    } while (json.consume(','));
+    json.expect('}');
+
+    std::sort(result.tensors.begin(), result.tensors.end(),
+              [](const TensorInfo& a, const TensorInfo& b) { return a.begin < b.begin; });
+    return result;
+}
+
+size_t dtype_size(const std::string& dtype) {
+    if (dtype == "F64" || dtype == "I64" || dtype == "U64") return 8;
+    if (dtype == "F32" || dtype == "I32" || dtype == "U32") return 4;
+    if (dtype == "BF16" || dtype == "F16" || dtype == "I16" || dtype == "U16") return 2;
+    return 1; // I8, U8, BOOL, F8_*
+}
+
+std::string json_escape(const std::string& s) {
+    std::string out;
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') { out += '\\'; out += c; }
+        else if (c < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else out += c;
+    }
+    return out;
+}
+
+// Serializes a header back to the safetensors layout, padded with spaces to 8 bytes
+std::vector<uint8_t> serialize_safetensors_header(const SafetensorsHeader& st) {
+    std::string json = "{";
+    bool first = true;
+    if (!st.metadata.empty()) {
+        json += "\"__metadata__\":" + st.metadata;
+        first = false;
+    }
+    for (const auto& t : st.tensors) {
+        if (!first) json += ',';
+        first = false;
+        json += "\"" + json_escape(t.name) + "\":{\"dtype\":\"" + t.dtype + "\",\"shape\":[";
+        for (size_t i = 0; i < t.shape.size(); ++i) {
+            if (i) json += ',';
+            json += std::to_string(t.shape[i]);
+        }
+        json += "],\"data_offsets\":[" + std::to_string(t.begin) + "," + std::to_string(t.end) + "]}";
+    }
+    json += '}';
+    while (json.size() % 8 != 0) json += ' ';
+    return std::vector<uint8_t>(json.begin(), json.end());
+}
+
+// Finds the first tensor whose data ends after `offset`
+std::vector<TensorInfo>::const_iterator tensor_at(const SafetensorsHeader& st, uint64_t offset) {
+    return std::upper_bound(st.tensors.begin(), st.tensors.end(), offset,
+                            [](uint64_t off, const TensorInfo& t) { return off < t.end; });
+}
+
+// 2D BF16 weights whose rows may be reordered by the row-permutation transform
+// (F32 ones qualify too when they are downcast on ingest)
+bool row_permutable(const TensorInfo& t, bool downcast_f32) {
+    return t.shape.size() == 2 && t.shape[0] > 1 && t.shape[1] > 0 &&
+           (t.dtype == "BF16" || (downcast_f32 && t.dtype == "F32"));
+}
+
+// --- PyTorch Checkpoint Front-End ---
+// torch.save() writes a zip of stored (uncompressed) entries: data.pkl holds the
+// pickled object tree and every storage is a data/<key> entry. The whole zip is
+// compressed as the data region, so it comes back byte for byte, and a synthetic
+// safetensors layout names each storage with the dtype its pickle records, so
+// chunks start at storage boundaries. Zip records and the pickle travel as
+// untyped bytes between the storages.
+struct ZipEntry {
+    std::string name;
+    uint16_t method = 0; // 0 = stored
+    uint64_t size = 0;   // Compressed size; equals the data size when stored
+    uint64_t data_offset = 0;
+};
+
+inline uint16_t zip_u16(const uint8_t* p) { return static_cast<uint16_t>(p[0] | p[1] << 8); }
+inline uint32_t zip_u32(const uint8_t* p) { return zip_u16(p) | static_cast<uint32_t>(zip_u16(p + 2)) << 16; }
+inline uint64_t zip_u64(const uint8_t* p) { return zip_u32(p) | static_cast<uint64_t>(zip_u32(p + 4)) << 32; }
+
+bool is_zip_file(std::istream& in) {
+    char magic[4] = {};
+    std::streampos current = in.tellg();
+    in.read(magic, sizeof(magic));
+    bool zip = in.gcount() == 4 && std::memcmp(magic, "PK\x03\x04", 4) == 0;
+    in.clear();
+    in.seekg(current, std::ios::beg);
+    return zip;
+}
+
+// Reads the central directory, following the zip64 records torch writes for
+// large checkpoints
+std::vector<ZipEntry> read_zip_directory(int fd, uint64_t file_size) {
+    size_t tail_size = static_cast<size_t>(std::min<uint64_t>(file_size, 22 + 65535));
+    std::vector<uint8_t> tail(tail_size);
+    pread_exact(fd, tail.data(), tail_size, file_size - tail_size);
+    size_t eocd = tail_size;
+    for (size_t i = tail_size >= 22 ? tail_size - 22 + 1 : 0; i-- > 0;) {
+        if (zip_u32(&tail[i]) == 0x06054b50) {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd == tail_size) throw std::runtime_error("Not a zip archive: no end of central directory");
+
+    uint64_t count = zip_u16(&tail[eocd + 10]);
+    uint64_t dir_size = zip_u32(&tail[eocd + 12]);
+    uint64_t dir_offset = zip_u32(&tail[eocd + 16]);
+    if (eocd >= 20 && zip_u32(&tail[eocd - 20]) == 0x07064b50) {
+        uint8_t rec[56];
+        pread_exact(fd, rec, sizeof(rec), zip_u64(&tail[eocd - 20 + 8]));
+        if (zip_u32(rec) != 0x06064b50) throw std::runtime_error("Corrupted zip64 directory record");
+        count = zip_u64(rec + 32);
+        dir_size = zip_u64(rec + 40);
+        dir_offset = zip_u64(rec + 48);
+    }
+    if (dir_offset + dir_size > file_size) throw std::runtime_error("Corrupted zip directory");
+
+    std::vector<uint8_t> dir(dir_size);
+    pread_exact(fd, dir.data(), dir_size, dir_offset);
+    std::vector<ZipEntry> entries;
+    size_t pos = 0;
+    for (uint64_t n = 0; n < count; ++n) {
+        if (pos + 46 > dir.size() || zip_u32(&dir[pos]) != 0x02014b50) throw std::runtime_error("Corrupted zip directory");
+        ZipEntry e;
+        e.method = zip_u16(&dir[pos + 10]);
+        e.size = zip_u32(&dir[pos + 20]);
+        uint64_t raw_size = zip_u32(&dir[pos + 24]);
+        uint64_t local = zip_u32(&dir[pos + 42]);
+        size_t name_len = zip_u16(&dir[pos + 28]), extra_len = zip_u16(&dir[pos + 30]), comment_len = zip_u16(&dir[pos + 32]);
+        if (pos + 46 + name_len + extra_len + comment_len > dir.size()) throw std::runtime_error("Corrupted zip directory");
+        e.name.assign(reinterpret_cast<const char*>(&dir[pos + 46]), name_len);
+        // Zip64 extra field: only the saturated 32-bit values are present, in this order
+        for (size_t x = pos + 46 + name_len; x + 4 <= pos + 46 + name_len + extra_len;) {
+            uint16_t id = zip_u16(&dir[x]), len = zip_u16(&dir[x + 2]);
+            size_t f = x + 4;
+            if (id == 0x0001) {
+                if (raw_size == 0xFFFFFFFF && f + 8 <= x + 4 + len) f += 8;
+                if (e.size == 0xFFFFFFFF && f + 8 <= x + 4 + len) {
+                    e.size = zip_u64(&dir[f]);
+                    f += 8;
+                }
+                if (local == 0xFFFFFFFF && f + 8 <= x + 4 + len) local = zip_u64(&dir[f]);
+            }
+            x += 4 + len;
+        }
+        pos += 46 + name_len + extra_len + comment_len;
+
+        uint8_t header[30];
+        pread_exact(fd, header, sizeof(header), local);
+        if (zip_u32(header) != 0x04034b50) throw std::runtime_error("Corrupted zip entry: " + e.name);
+        e.data_offset = local + sizeof(header) + zip_u16(header + 26) + zip_u16(header + 28);
+        if (e.data_offset + e.size > file_size) throw std::runtime_error("Truncated zip entry: " + e.name);
+        entries.push_back(e);
+    }
+    return entries;
+}
+
+// Just enough of the pickle machine to collect torch's persistent storage ids,
+// ('storage', <class torch.XStorage>, key, location, numel), without importing
+// or calling anything: values are strings, ints, globals, tuples or opaque.
+struct PickleValue {
+    enum Kind { OPAQUE, MARK, STRING, INT, GLOBAL, TUPLE } kind = OPAQUE;
+    std::string text; // STRING; GLOBAL as "module.name"
+    int64_t number = 0;
+    std::vector<PickleValue> items;
+};
+
+struct StorageRef {
+    std::string key;
+    std::string storage_type; // e.g. torch.BFloat16Storage
+    int64_t numel = 0;
+};
+
+std::vector<StorageRef> pickle_storages(const std::vector<uint8_t>& pkl) {
+    std::vector<PickleValue> stack, memo;
+    std::vector<StorageRef> refs;
+    size_t pos = 0;
+    auto need = [&](size_t n) -> const uint8_t* {
+        if (pkl.size() - pos < n) throw std::runtime_error("Truncated pickle");
+        pos += n;
+        return &pkl[pos - n];
+    };
+    auto pop = [&]() {
+        if (stack.empty()) throw std::runtime_error("Malformed pickle: stack underflow");
+        PickleValue v = std::move(stack.back());
+        stack.pop_back();
+        return v;
+    };
+    auto pop_mark = [&]() {
+        std::vector<PickleValue> items;
+        while (!stack.empty() && stack.back().kind != PickleValue::MARK) items.insert(items.begin(), pop());
+        if (stack.empty()) throw std::runtime_error("Malformed pickle: missing mark");
+        stack.pop_back();
+        return items;
+    };
+    auto push_string = [&](size_t n) {
+        PickleValue v;
+        v.kind = PickleValue::STRING;
+        v.text.assign(reinterpret_cast<const char*>(need(n)), n);
+        stack.push_back(v);
+    };
+    auto push_int = [&](int64_t n) {
+        PickleValue v;
+        v.kind = PickleValue::INT;
+        v.number = n;
+        stack.push_back(v);
+    };
+    auto push_tuple = [&](std::vector<PickleValue> items) {
+        PickleValue v;
+        v.kind = PickleValue::TUPLE;
+        v.items = std::move(items);
+        stack.push_back(v);
+    };
+    auto put_memo = [&](size_t idx) {
+        if (stack.empty()) throw std::runtime_error("Malformed pickle: memo of empty stack");
+        if (memo.size() <= idx) memo.resize(idx + 1);
+        memo[idx] = stack.back();
+    };
+    auto get_memo = [&](size_t idx) {
+        if (idx >= memo.size()) throw std::runtime_error("Malformed pickle: unknown memo entry");
+        stack.push_back(memo[idx]);
+    };
+    auto line = [&]() {
+        size_t end = pos;
+        while (end < pkl.size() && pkl[end] != '\n') ++end;
+        std::string text(reinterpret_cast<const char*>(need(end - pos)), end - pos);
+        need(1);
+        return text;
+    };
+
+    while (true) {
+        uint8_t op = *need(1);
+        switch (op) {
+        case 0x80: need(1); break;                        // PROTO
+        case 0x95: need(8); break;                        // FRAME
+        case '(': stack.push_back(PickleValue()); stack.back().kind = PickleValue::MARK; break;
+        case '}': case ']': case 'N': case 0x88: case 0x89: case 0x8f: stack.push_back(PickleValue()); break;
+        case ')': push_tuple({}); break;
+        case 'X': push_string(zip_u32(need(4))); break;   // BINUNICODE
+        case 0x8c: push_string(*need(1)); break;          // SHORT_BINUNICODE
+        case 0x8d: push_string(zip_u64(need(8))); break;  // BINUNICODE8
+        case 'U': push_string(*need(1)); break;           // SHORT_BINSTRING
+        case 'T': push_string(zip_u32(need(4))); break;   // BINSTRING
+        case 'C': need(*need(1)); stack.push_back(PickleValue()); break;          // SHORT_BINBYTES
+        case 'B': need(zip_u32(need(4))); stack.push_back(PickleValue()); break;  // BINBYTES
+        case 0x8e: need(zip_u64(need(8))); stack.push_back(PickleValue()); break; // BINBYTES8
+        case 'J': push_int(static_cast<int32_t>(zip_u32(need(4)))); break;
+        case 'K': push_int(*need(1)); break;
+        case 'M': push_int(zip_u16(need(2))); break;
+        case 0x8a: {                                      // LONG1
+            size_t n = *need(1);
+            const uint8_t* p = need(n);
+            int64_t v = 0;
+            for (size_t i = 0; i < n && i < 8; ++i) v |= static_cast<int64_t>(p[i]) << (8 * i);
+            if (n > 0 && n < 8 && (p[n - 1] & 0x80)) v -= int64_t(1) << (8 * n);
+            push_int(v);
+            break;
+        }
+        case 'G': need(8); stack.push_back(PickleValue()); break;
+        case 'c': {                                       // GLOBAL
+            std::string module = line();
+            PickleValue v;
+            v.kind = PickleValue::GLOBAL;
+            v.text = module + "." + line();
+            stack.push_back(v);
+            break;
+        }
+        case 0x93: {                                      // STACK_GLOBAL
+            PickleValue name = pop(), module = pop();
+            PickleValue v;
+            v.kind = PickleValue::GLOBAL;
+            v.text = module.text + "." + name.text;
+            stack.push_back(v);
+            break;
+        }
+        case 't': push_tuple(pop_mark()); break;
+        case 0x85: { PickleValue a = pop(); push_tuple({a}); break; }
+        case 0x86: { PickleValue b = pop(), a = pop(); push_tuple({a, b}); break; }
+        case 0x87: { PickleValue c = pop(), b = pop(), a = pop(); push_tuple({a, b, c}); break; }
+        case 'q': put_memo(*need(1)); break;              // BINPUT
+        case 'r': put_memo(zip_u32(need(4))); break;      // LONG_BINPUT
+        case 0x94: put_memo(memo.size()); break;          // MEMOIZE
+        case 'h': get_memo(*need(1)); break;              // BINGET
+        case 'j': get_memo(zip_u32(need(4))); break;      // LONG_BINGET
+        case 's': pop(); pop(); break;                    // SETITEM
+        case 'a': case 'b': case '0': pop(); break;       // APPEND, BUILD, POP
+        case 'u': case 'e': case 0x90: case '1': pop_mark(); break; // SETITEMS, APPENDS, ADDITEMS, POP_MARK
+        case '2': stack.push_back(stack.empty() ? PickleValue() : stack.back()); break;
+        case 'R': case 0x81: pop(); pop(); stack.push_back(PickleValue()); break;  // REDUCE, NEWOBJ
+        case 0x92: pop(); pop(); pop(); stack.push_back(PickleValue()); break;    // NEWOBJ_EX
+        case 0x91: pop_mark(); stack.push_back(PickleValue()); break;              // FROZENSET
+        case 'Q': {                                       // BINPERSID
+            PickleValue pid = pop();
+            if (pid.kind == PickleValue::TUPLE && pid.items.size() >= 5 && pid.items[0].text == "storage" &&
+                pid.items[1].kind == PickleValue::GLOBAL && pid.items[2].kind == PickleValue::STRING)
+                refs.push_back({pid.items[2].text, pid.items[1].text, pid.items[4].number});
+            stack.push_back(PickleValue());
+            break;
+        }
+        case '.': return refs;                            // STOP
+        default: {
+            char hex[8];
+            std::snprintf(hex, sizeof(hex), "0x%02x", op);
+            throw std::runtime_error(std::string("Unsupported pickle opcode ") + hex);
+        }
+        }
+    }
+}
+
+std::string storage_dtype(const std::string& storage_type) {
+    static const std::pair<const char*, const char*> types[] = {
+        {"torch.BFloat16Storage", "BF16"}, {"torch.HalfStorage", "F16"}, {"torch.FloatStorage", "F32"},
+        {"torch.DoubleStorage", "F64"},    {"torch.LongStorage", "I64"}, {"torch.IntStorage", "I32"},
+        {"torch.ShortStorage", "I16"},     {"torch.CharStorage", "I8"},  {"torch.ByteStorage", "U8"},
+        {"torch.BoolStorage", "BOOL"}};
+    for (const auto& t : types)
+        if (storage_type == t.first) return t.second;
+    return "U8";
+}
+
+// Layout of a PyTorch zip checkpoint: one tensor per stored storage entry, at
+// its offset in the file. Storages the pickle does not type are kept as U8.
+SafetensorsHeader pytorch_layout(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Cannot open input: " + path);
+    SafetensorsHeader st;
+    try {
+        struct stat info;
+        if (::fstat(fd, &info) != 0) throw std::runtime_error("Cannot stat input: " + path);
+        std::vector<ZipEntry> entries = read_zip_directory(fd, info.st_size);
+
+        auto pkl = std::find_if(entries.begin(), entries.end(), [](const ZipEntry& e) {
+            return e.name == "data.pkl" || (e.name.size() > 9 && e.name.compare(e.name.size() - 9, 9, "/data.pkl") == 0);
+        });
+        if (pkl == entries.end()) throw std::runtime_error("Not a PyTorch checkpoint (no data.pkl): " + path);
+        std::string prefix = pkl->name.substr(0, pkl->name.size() - 8) + "data/";
+
+        std::vector<StorageRef> refs;
+        if (pkl->method == 0) {
+            std::vector<uint8_t> bytes(pkl->size);
+            pread_exact(fd, bytes.data(), bytes.size(), pkl->data_offset);
+            try {
+                refs = pickle_storages(bytes);
+            } catch (const std::exception& e) {
+                std::cout << "Cannot read storage types (" << e.what() << "), keeping storages untyped" << std::endl;
+            }
+        }
+
+        size_t typed = 0;
+        for (const auto& e : entries) {
+            if (e.method != 0 || e.size == 0 || e.name.compare(0, prefix.size(), prefix) != 0) continue;
+            std::string key = e.name.substr(prefix.size());
+            auto ref = std::find_if(refs.begin(), refs.end(), [&](const StorageRef& r) { return r.key == key; });
+            TensorInfo t;
+            t.name = e.name;
+            t.dtype = ref == refs.end() ? "U8" : storage_dtype(ref->storage_type);
+            if (e.size % dtype_size(t.dtype) != 0) t.dtype = "U8";
+            typed += ref != refs.end();
+            t.shape.push_back(e.size / dtype_size(t.dtype));
+            t.begin = e.data_offset;
+            t.end = e.data_offset + e.size;
+            st.tensors.push_back(t);
+        }
+        std::sort(st.tensors.begin(), st.tensors.end(),
+                  [](const TensorInfo& a, const TensorInfo& b) { return a.begin < b.begin; });
+        for (size_t i = 0; i < st.tensors.size(); ++i) st.tensors[i].key_order = i;
+        st.metadata = "{\"format\":\"pytorch\"}";
+        std::cout << "PyTorch checkpoint: " << st.tensors.size() << " storages in " << entries.size()
+                  << " zip entries, " << typed << " typed from the pickle" << std::endl;
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    return st;
+}
+
+// --- Chunk Planning ---
+// Splits the tensor data region into chunks of at most chunk_size bytes. With a
+// known layout, boundaries never split an element (or a row, when rows are
+// permuted), and in_* / out_* differ when tensors change size on ingest
+// (F32 -> BF16 downcast).
+struct ChunkPlan {
+    uint64_t in_offset = 0;
+    uint64_t in_size = 0;
+    uint64_t out_offset = 0;
+    uint64_t out_size = 0;
+    std::vector<ChunkSegment> packed; // Gathered pieces in frame order; empty for a contiguous chunk
+};
+
+std::vector<ChunkPlan> plan_chunks(uint64_t data_size, const SafetensorsHeader* layout, bool downcast_f32,
+                                   bool align_rows, bool tensor_aligned, uint64_t chunk_size) {
+    std::vector<ChunkPlan> plan;
+    uint64_t offset = 0;
+    uint64_t out_offset = 0;
+    while (offset < data_size) {
+        uint64_t end = std::min(offset + chunk_size, data_size);
+        uint64_t out_size = end - offset;
+        if (layout) {
+            auto it = tensor_at(*layout, end);
+            // Tensor-aligned: never start a tensor mid-chunk, so boundaries only move
+            // where a tensor before them changed size
+            if (tensor_aligned && end < data_size && it != layout->tensors.end() && it->begin > offset &&
+                it->begin < end)
+                end = it->begin;
+            else if (end < data_size && it != layout->tensors.end() && it->begin < end) {
+                uint64_t unit = dtype_size(it->dtype);
+                if (align_rows && row_permutable(*it, downcast_f32) && it->shape[1] * unit <= chunk_size)
+                    unit *= it->shape[1];
+                uint64_t aligned = it->begin + (end - it->begin) / unit * unit;
+                if (aligned > offset) end = aligned;
+            }
+            out_size = end - offset;
+            if (downcast_f32) {
+                for (auto t = tensor_at(*layout, offset); t != layout->tensors.end() && t->begin < end; ++t) {
+                    if (t->dtype == "F32") out_size -= (std::min(t->end, end) - std::max(t->begin, offset)) / 2;
+                }
+            }
+        }
+        plan.push_back({offset, end - offset, out_offset, out_size, {}});
+        offset = end;
+        out_offset += out_size;
+    }
+    return plan;
+}
+
+// Packed planning: tensors of at least PACK_TENSOR_LIMIT bytes get chunks of
+// their own, smaller ones are gathered per dtype into frames of about
+// PACK_FRAME_SIZE. A norm or bias then decodes from a small frame instead of a
+// 32MB chunk, without paying a frame per tensor. Bytes outside any tensor are
+// gathered the same way.
+std::vector<ChunkPlan> plan_packed_chunks(uint64_t data_size, const SafetensorsHeader& layout, uint64_t chunk_size) {
+    std::vector<ChunkPlan> plan;
+    std::vector<std::pair<std::string, size_t>> open; // dtype -> pack being filled
+    auto add_small = [&](const std::string& dtype, uint64_t offset, uint64_t size) {
+        auto it = std::find_if(open.begin(), open.end(),
+                               [&](const std::pair<std::string, size_t>& o) { return o.first == dtype; });
+        if (it == open.end() || plan[it->second].in_size + size > PACK_FRAME_SIZE) {
+            plan.emplace_back();
+            plan.back().in_offset = offset;
+            if (it == open.end()) it = open.insert(open.end(), {dtype, 0});
+            it->second = plan.size() - 1;
+        }
+        ChunkPlan& p = plan[it->second];
+        p.packed.push_back({offset, size, 0, p.in_size});
+        p.in_size += size;
+    };
+
+    uint64_t offset = 0;
+    for (const auto& t : layout.tensors) {
+        uint64_t begin = std::max(t.begin, offset), end = std::min(t.end, data_size);
+        if (begin > offset) add_small("", offset, begin - offset);
+        if (end <= begin) continue;
+        if (t.end - t.begin < PACK_TENSOR_LIMIT) {
+            add_small(t.dtype, begin, end - begin);
+        } else {
+            for (uint64_t pos = begin; pos < end; pos += chunk_size) {
+                plan.emplace_back();
+                plan.back().in_offset = pos;
+                plan.back().in_size = std::min<uint64_t>(chunk_size, end - pos);
+            }
+        }
+        offset = end;
+    }
+    if (offset < data_size) add_small("", offset, data_size - offset);
+
+    // Frames must hold whole BF16 pairs: odd-sized ones (odd-length U8 or BOOL
+    // tensors) are merged two by two
+    size_t odd = plan.size();
+    for (size_t i = 0; i < plan.size(); ++i) {
+        if (plan[i].in_size % 2 == 0) continue;
+        if (odd == plan.size()) {
+            odd = i;
+            continue;
+        }
+        for (ChunkPlan* p : {&plan[odd], &plan[i]})
+            if (p->packed.empty()) p->packed.push_back({p->in_offset, p->in_size, 0, 0});
+        for (auto seg : plan[i].packed) {
+            seg.frame_offset += plan[odd].in_size;
+            plan[odd].packed.push_back(seg);
+        }
+        plan[odd].in_size += plan[i].in_size;
+        plan[i].in_size = 0;
+        odd = plan.size();
+    }
+    plan.erase(std::remove_if(plan.begin(), plan.end(), [](const ChunkPlan& p) { return p.in_size == 0; }), plan.end());
+
+    std::sort(plan.begin(), plan.end(), [](const ChunkPlan& a, const ChunkPlan& b) { return a.in_offset < b.in_offset; });
+    for (size_t i = 0; i < plan.size(); ++i) {
+        ChunkPlan& p = plan[i];
+        if (p.packed.size() == 1) p.packed.clear(); // A lone piece is just a contiguous chunk
+        for (auto& seg : p.packed) seg.chunk = i;
+        p.out_offset = p.in_offset;
+        p.out_size = p.in_size;
+    }
+    return plan;
+}
+
+// --- BF16 Logic ---
+void shuffle_bf16(const uint8_t* src, uint8_t* dst, size_t size) {
+    size_t half = size / 2;
+    for (size_t i = 0; i < half; ++i) {
+        dst[i] = src[2 * i + 1];      // High Byte
+        dst[half + i] = src[2 * i];   // Low Byte
+    }
+}
+
+void unshuffle_bf16(const uint8_t* src, uint8_t* dst, size_t size) {
+    size_t half = size / 2;
+    for (size_t i = 0; i < half; ++i) {
+        dst[2 * i + 1] = src[i];      // High Byte
+        dst[2 * i] = src[half + i];   // Low Byte
+    }
+}
+
+// Same as unshuffle_bf16, but streams the output past the cache. Used when
+// writing straight into a mapped output file that is not read back soon.
+void unshuffle_bf16_nt(const uint8_t* src, uint8_t* dst, size_t size) {
+#ifdef __SSE2__
+    size_t half = size / 2;
+    size_t i = 0;
+    // Scalar head until dst is 16-byte aligned (dst is always even)
+    for (; i < half && (reinterpret_cast<uintptr_t>(dst + 2 * i) & 15) != 0; ++i) {
+        dst[2 * i + 1] = src[i];
+        dst[2 * i] = src[half + i];
+    }
+    for (; i + 16 <= half; i += 16) {
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + half + i));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 2 * i), _mm_unpacklo_epi8(lo, hi));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 2 * i + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+    for (; i < half; ++i) {
+        dst[2 * i + 1] = src[i];
+        dst[2 * i] = src[half + i];
+    }
+    _mm_sfence();
+#else
+    unshuffle_bf16(src, dst, size);
+#endif
+}
+
+// --- Lossy Mantissa Rounding ---
+// Rounds a BF16 value to keep `bits` mantissa bits (round-to-nearest-even),
+// which is off by at most 2^-(bits+1) relative. Values where that does not hold
+// pass through unrounded: Inf/NaN, subnormals (no implicit leading 1, so they
+// could flush to zero) and values that would round up to Inf.
+inline uint16_t round_bf16_mantissa(uint16_t v, int bits) {
+    int drop = BF16_MANTISSA_BITS - bits;
+    if (drop <= 0 || (v & 0x7F80) == 0x7F80 || (v & 0x7F80) == 0) return v;
+    uint16_t mask = static_cast<uint16_t>((1u << drop) - 1);
+    uint32_t bias = ((1u << (drop - 1)) - 1) + ((v >> drop) & 1u);
+    uint16_t r = static_cast<uint16_t>((v + bias) & ~mask);
+    if ((r & 0x7F80) == 0x7F80) return v;
+    return r;
+}
+
+inline float bf16_to_float(uint16_t v) {
+    uint32_t bits = static_cast<uint32_t>(v) << 16;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+struct RoundingStats {
+    size_t tensor = 0;
+    double max_abs_error = 0.0;
+    double sum_abs_error = 0.0;
+    uint64_t elements = 0;
+    uint64_t unrounded = 0; // Values left with all their mantissa bits
+};
+
+RoundingStats round_bf16_range(uint8_t* data, size_t count, int bits) {
+    RoundingStats stats;
+    stats.elements = count;
+    for (size_t i = 0; i < count; ++i) {
+        uint16_t v;
+        std::memcpy(&v, data + 2 * i, sizeof(v));
+        uint16_t r = round_bf16_mantissa(v, bits);
+        if (r & ((1u << (BF16_MANTISSA_BITS - bits)) - 1)) stats.unrounded++;
+        if (r == v) continue;
+        std::memcpy(data + 2 * i, &r, sizeof(r));
+        double err = std::fabs(static_cast<double>(bf16_to_float(r)) - bf16_to_float(v));
+        if (err > stats.max_abs_error) stats.max_abs_error = err;
+        stats.sum_abs_error += err;
+    }
+    return stats;
+}
+
+// --- FP32 -> BF16 Downcast ---
+// Round-to-nearest-even on the upper 16 bits; NaNs stay quiet NaNs. Written
+// branch-free over independent elements so the loop vectorizes.
+void f32_to_bf16(const uint8_t* src, uint8_t* dst, size_t count) {
+    #pragma omp simd
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t x;
+        std::memcpy(&x, src + 4 * i, sizeof(x));
+        uint32_t rounded = (x + 0x7FFFu + ((x >> 16) & 1u)) >> 16;
+        uint32_t quiet = (x >> 16) | 0x0040u;
+        uint16_t v = static_cast<uint16_t>(((x & 0x7FFFFFFFu) > 0x7F800000u) ? quiet : rounded);
+        std::memcpy(dst + 2 * i, &v, sizeof(v));
+    }
+}
+
+// Rewrites the header so every F32 tensor is stored as BF16 with shifted offsets
+SafetensorsHeader downcast_layout(const SafetensorsHeader& in, uint64_t& converted) {
+    SafetensorsHeader out = in;
+    uint64_t shrink = 0;
+    converted = 0;
+    for (auto& t : out.tensors) {
+        uint64_t size = t.end - t.begin;
+        t.begin -= shrink;
+        if (t.dtype == "F32") {
+            t.dtype = "BF16";
+            shrink += size / 2;
+            converted++;
+        }
+        t.end -= shrink;
+    }
+    return out;
+}
+
+// Converts the F32 spans of a planned chunk from src into dst, copying everything else
+void downcast_chunk(const uint8_t* src, uint8_t* dst, const ChunkPlan& p, const SafetensorsHeader& in) {
+    uint64_t pos = p.in_offset;
+    uint64_t end = p.in_offset + p.in_size;
+    uint8_t* out = dst;
+    for (auto t = tensor_at(in, pos); t != in.tensors.end() && t->begin < end; ++t) {
+        if (t->dtype != "F32") continue;
+        uint64_t lo = std::max(t->begin, pos);
+        uint64_t hi = std::min(t->end, end);
+        std::memcpy(out, src + (pos - p.in_offset), lo - pos);
+        out += lo - pos;
+        size_t count = (hi - lo) / 4;
+        f32_to_bf16(src + (lo - p.in_offset), out, count);
+        out += 2 * count;
+        pos = hi;
+    }
+    std::memcpy(out, src + (pos - p.in_offset), end - pos);
+}
+
+// --- Row Permutation ---
+// Rows of 2D BF16 weights are stably sorted by their largest exponent so that
+// rows of similar magnitude sit together in the exponent plane. Only the sort
+// key of every row (1 byte) is stored; the decoder rebuilds the same stable
+// permutation from it and scatters the rows back.
+struct RowSegment {
+    uint64_t offset = 0;    // Byte offset inside the chunk
+    uint64_t rows = 0;
+    uint64_t row_bytes = 0;
+};
+
+std::vector<RowSegment> row_segments(const SafetensorsHeader& layout, uint64_t offset, uint64_t size) {
+    std::vector<RowSegment> segments;
+    uint64_t end = offset + size;
+    for (auto t = tensor_at(layout, offset); t != layout.tensors.end() && t->begin < end; ++t) {
+        if (!row_permutable(*t, false)) continue;
+        uint64_t row_bytes = t->shape[1] * 2;
+        uint64_t lo = std::max(t->begin, offset);
+        uint64_t hi = std::min(t->end, end);
+        if ((lo - t->begin) % row_bytes != 0 || (hi - t->begin) % row_bytes != 0) continue;
+        uint64_t rows = (hi - lo) / row_bytes;
+        if (rows > 1) segments.push_back({lo - offset, rows, row_bytes});
+    }
+    return segments;
+}
+
+size_t row_key_bytes(const std::vector<RowSegment>& segments) {
+    size_t n = 0;
+    for (const auto& s : segments) n += s.rows;
+    return n;
+}
+
+uint8_t row_exponent_key(const uint8_t* row, uint64_t count) {
+    uint16_t max_mag = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint16_t v;
+        std::memcpy(&v, row + 2 * i, sizeof(v));
+        max_mag = std::max<uint16_t>(max_mag, v & 0x7FFF);
+    }
+    return static_cast<uint8_t>(max_mag >> 7);
+}
+
+std::vector<uint32_t> rows_by_key(const uint8_t* keys, uint64_t rows) {
+    std::vector<uint32_t> order(rows);
+    for (uint64_t r = 0; r < rows; ++r) order[r] = static_cast<uint32_t>(r);
+    std::stable_sort(order.begin(), order.end(), [keys](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+    return order;
+}
+
+// Sorts the rows of every segment in place (using tmp as staging) and appends their keys
+void permute_rows(uint8_t* data, uint8_t* tmp, const std::vector<RowSegment>& segments, std::vector<uint8_t>& keys) {
+    keys.clear();
+    for (const auto& s : segments) {
+        uint8_t* base = data + s.offset;
+        size_t first_key = keys.size();
+        for (uint64_t r = 0; r < s.rows; ++r) keys.push_back(row_exponent_key(base + r * s.row_bytes, s.row_bytes / 2));
+        std::vector<uint32_t> order = rows_by_key(keys.data() + first_key, s.rows);
+        for (uint64_t r = 0; r < s.rows; ++r) std::memcpy(tmp + r * s.row_bytes, base + order[r] * s.row_bytes, s.row_bytes);
+        std::memcpy(base, tmp, s.rows * s.row_bytes);
+    }
+}
+
+void unpermute_rows(uint8_t* data, uint8_t* tmp, const std::vector<RowSegment>& segments, const uint8_t* keys) {
+    for (const auto& s : segments) {
+        uint8_t* base = data + s.offset;
+        std::vector<uint32_t> order = rows_by_key(keys, s.rows);
+        std::memcpy(tmp, base, s.rows * s.row_bytes);
+        for (uint64_t r = 0; r < s.rows; ++r) std::memcpy(base + order[r] * s.row_bytes, tmp + r * s.row_bytes, s.row_bytes);
+        keys += s.rows;
+    }
+}
+
+// Low-plane packing: after rounding, each low byte only carries its top
+// (1 + mantissa bits) bits (exponent LSB + kept mantissa), so they are stored
+// as `width`-bit fields. Packing works in place because dst never passes src.
+size_t packed_size(size_t count, int width) {
+    return (count * width + 7) / 8;
+}
+
+void pack_low_plane(uint8_t* plane, size_t count, int width) {
+    if (width >= 8) return;
+    int shift = 8 - width;
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    size_t out = 0;
+    for (size_t i = 0; i < count; ++i) {
+        acc |= static_cast<uint64_t>(plane[i] >> shift) << acc_bits;
+        acc_bits += width;
+        while (acc_bits >= 8) {
+            plane[out++] = static_cast<uint8_t>(acc);
+            acc >>= 8;
+            acc_bits -= 8;
+        }
+    }
+    if (acc_bits > 0) plane[out] = static_cast<uint8_t>(acc);
+}
+
+void unpack_low_plane(const uint8_t* src, uint8_t* dst, size_t count, int width) {
+    if (width >= 8) {
+        std::memcpy(dst, src, count);
+        return;
+    }
+    int shift = 8 - width;
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    uint8_t mask = static_cast<uint8_t>((1u << width) - 1);
+    for (size_t i = 0; i < count; ++i) {
+        if (acc_bits < width) {
+            acc |= static_cast<uint64_t>(*src++) << acc_bits;
+            acc_bits += 8;
+        }
+        dst[i] = static_cast<uint8_t>((acc & mask) << shift);
+        acc >>= width;
+        acc_bits -= width;
+    }
+}
+
+// --- Data Structure for Parallel Processing ---
+struct Chunk {
+    std::vector<uint8_t> raw_data;
+    std::vector<uint8_t> comp_data;
+    std::vector<uint8_t> scratch_buffer; // For shuffling
+    uint64_t raw_size = 0;
+    uint64_t comp_size = 0;
+    uint64_t offset = 0;                 // Position in the tensor data region
+    int low_bits = 8;                    // Width of the packed low-byte plane
+    std::vector<RoundingStats> rounding;
+    std::vector<RowSegment> row_segments;
+    std::vector<uint8_t> row_keys;
+    std::vector<uint8_t> mantissa;       // Progressive: packed mantissa plane, then its frame
+    std::vector<uint8_t> mant_comp;
+    uint64_t mantissa_size = 0;
+    uint64_t mant_comp_size = 0;
+    const uint8_t* comp_view = nullptr;  // Frames inside a mapped archive; the buffers above are used when null
+    const uint8_t* mant_view = nullptr;
+};
+
+// --- Compression Options ---
+struct CompressOptions {
+    int level = DEFAULT_COMPRESSION_LEVEL;
+    int mantissa_bits = BF16_MANTISSA_BITS;
+    std::vector<std::pair<std::string, int>> mantissa_overrides; // fnmatch pattern -> bits
+    bool downcast_f32 = false;
+    bool permute_rows = false;
+    bool progressive = false;       // Exponent planes first, mantissas in separate trailing frames
+    bool tensor_chunks = false;     // Cut chunks at tensor starts, for stable incremental hashes
+    bool pack_small = false;        // Own chunks for large tensors, shared frames for small ones
+    bool verify = false;            // Decode every fresh frame and compare it before committing it
+    uint64_t chunk_size = CHUNK_SIZE; // Largest chunk (frame) planned; smaller means cheaper random reads
+    std::string reuse_path;         // Previous archive whose frames are reused for unchanged chunks
+    bool quiet = false;             // No progress or summary on stdout (several files at once)
+    bool schedule_lpt = false;      // Dispatch chunks longest-predicted-first instead of in file order
+    bool background = false;        // Idle CPU/I/O priority, workers throttled by system pressure
+    bool follow = false;            // Input is still being written; wait for its bytes
+    double follow_timeout = 60.0;   // Give up once the input stops growing for this long
+    ThrottleOptions throttle;
+    std::vector<int> levels;        // Fan-out: compress every chunk at each of these levels
+    bool sizes_only = false;        // Fan-out: report sizes and times without writing archives
+    std::string levels_csv;
+
+    bool lossy() const {
+        if (mantissa_bits < BF16_MANTISSA_BITS) return true;
+        for (const auto& o : mantissa_overrides)
+            if (o.second < BF16_MANTISSA_BITS) return true;
+        return false;
+    }
+
+    int mantissa_bits_for(const std::string& tensor) const {
+        int bits = mantissa_bits;
+        for (const auto& o : mantissa_overrides)
+            if (fnmatch(o.first.c_str(), tensor.c_str(), 0) == 0) bits = o.second;
+        return bits;
+    }
+};
+
+// Rounds the BF16 tensors overlapping the chunk and returns the narrowest
+// low-plane width that still holds every byte of it losslessly.
+int round_chunk(Chunk& c, const SafetensorsHeader& st, const std::vector<int>& tensor_bits) {
+    c.rounding.clear();
+    uint64_t chunk_end = c.offset + c.raw_size;
+    uint64_t covered = c.offset;
+    int kept = 0;
+
+    for (auto it = tensor_at(st, c.offset); it != st.tensors.end() && it->begin < chunk_end; ++it) {
+        size_t idx = it - st.tensors.begin();
+        uint64_t lo = std::max(it->begin, c.offset);
+        uint64_t hi = std::min(it->end, chunk_end);
+        if (lo > covered) kept = BF16_MANTISSA_BITS; // Bytes outside any tensor
+        covered = std::max(covered, hi);
+
+        int bits = tensor_bits[idx];
+        if (it->dtype != "BF16" || (it->begin % 2) != 0 || bits >= BF16_MANTISSA_BITS) {
+            kept = BF16_MANTISSA_BITS;
+            continue;
+        }
+        RoundingStats stats = round_bf16_range(c.raw_data.data() + (lo - c.offset), (hi - lo) / 2, bits);
+        stats.tensor = idx;
+        c.rounding.push_back(stats);
+        // An unrounded value needs the full low plane
+        kept = std::max(kept, stats.unrounded ? BF16_MANTISSA_BITS : bits);
+    }
+    if (covered < chunk_end) kept = BF16_MANTISSA_BITS;
+    return 1 + kept;
+}
+
+// --- Chunk Hashing ---
+// XXH64, used to recognise input chunks that are unchanged since a previous archive
+constexpr uint64_t XXH_PRIME1 = 11400714785074694791ULL;
+constexpr uint64_t XXH_PRIME2 = 14029467366897019727ULL;
+constexpr uint64_t XXH_PRIME3 = 1609587929392839161ULL;
+constexpr uint64_t XXH_PRIME4 = 9650029242287828579ULL;
+constexpr uint64_t XXH_PRIME5 = 2870177450012600261ULL;
+
+inline uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    return xxh_rotl(acc, 31) * XXH_PRIME1;
+}
+
+inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t xxh64(const void* data, size_t size, uint64_t seed) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* end = p + size;
+    auto read64 = [](const uint8_t* q) { uint64_t v; std::memcpy(&v, q, 8); return v; };
+    auto read32 = [](const uint8_t* q) { uint32_t v; std::memcpy(&v, q, 4); return v; };
+    uint64_t h;
+    if (size >= 32) {
+        uint64_t v1 = seed + XXH_PRIME1 + XXH_PRIME2, v2 = seed + XXH_PRIME2, v3 = seed, v4 = seed - XXH_PRIME1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+        }
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(xxh_merge(xxh_merge(xxh_merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + XXH_PRIME5;
+    }
+    h += size;
+    for (; p + 8 <= end; p += 8) h = xxh_rotl(h ^ xxh_round(0, read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (p + 4 <= end) {
+        h = xxh_rotl(h ^ (read32(p) * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p) h = xxh_rotl(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    return h ^ (h >> 32);
+}
+
+// --- Follow Mode ---
+// Blocks until the file at `path` exists and holds at least `size` bytes. The
+// writer is assumed to append in order, as safetensors writers do; the file
+// size is the only signal, so a writer that preallocates is not supported.
+void wait_for_size(const std::string& path, uint64_t size, double timeout) {
+    int64_t last = -1;
+    Timer idle;
+    for (;;) {
+        struct stat st;
+        int64_t now = ::stat(path.c_str(), &st) == 0 ? static_cast<int64_t>(st.st_size) : -1;
+        if (now >= 0 && static_cast<uint64_t>(now) >= size) return;
+        if (now != last) {
+            last = now;
+            idle = Timer();
+        } else if (idle.elapsed() > timeout) {
+            throw std::runtime_error("Input stopped growing at " + std::to_string(std::max<int64_t>(now, 0)) + " bytes");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+}
+
+// --- Background Mode ---
+// Compression on a node that also trains: every worker runs at idle CPU and
+// I/O priority, and a governor parks workers while other tasks are under CPU
+// or I/O pressure (PSI), so compression only soaks up slack.
+constexpr int IOPRIO_CLASS_IDLE = 3;
+constexpr int IOPRIO_CLASS_SHIFT = 13;
+constexpr int IOPRIO_WHO_PROCESS = 1;
+constexpr double PSI_SHRINK_PCT = 10.0; // Stall share of other tasks above this parks a worker
+constexpr double PSI_GROW_PCT = 2.0;    // and below this wakes one up
+
+// Scheduling state of the calling thread, put back once its work is done
+struct ThreadPriority {
+    int policy = SCHED_OTHER;
+    sched_param param = {};
+    int nice = 0;
+    long ioprio = -1;
+};
+
+ThreadPriority lower_thread_priority() {
+    ThreadPriority saved;
+    pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+    pthread_getschedparam(pthread_self(), &saved.policy, &saved.param);
+    errno = 0;
+    saved.nice = getpriority(PRIO_PROCESS, static_cast<id_t>(tid));
+    if (errno != 0) saved.nice = 0;
+    saved.ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+
+    sched_param param = {};
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+        setpriority(PRIO_PROCESS, static_cast<id_t>(tid), 19);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    return saved;
+}
+
+// Pool threads outlive the region; later work (the next watch job, the next
+// file of a batch) must not inherit idle priority. Leaving SCHED_IDLE or
+// lowering the nice value needs RLIMIT_NICE headroom or CAP_SYS_NICE, so this
+// can fail for unprivileged users; false then.
+bool restore_thread_priority(const ThreadPriority& saved) {
+    bool ok = pthread_setschedparam(pthread_self(), saved.policy, &saved.param) == 0;
+    ok &= setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), saved.nice) == 0;
+    if (saved.ioprio >= 0) ok &= syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, saved.ioprio) == 0;
+    return ok;
+}
+
+// Cumulative stall time in microseconds ("total=") of the "some" or "full"
+// line of a PSI file, or -1 when pressure information is unavailable
+double psi_total_us(const char* path, const char* kind) {
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t pos = line.find("total=");
+        if (line.compare(0, std::strlen(kind), kind) == 0 && pos != std::string::npos)
+            return std::stod(line.substr(pos + 6));
+    }
+    return -1.0;
+}
+
+// Runqueue wait (schedstat run_delay, ns) of every thread of this process
+std::vector<std::pair<long, uint64_t>> own_run_delays() {
+    std::vector<std::pair<long, uint64_t>> delays;
+    DIR* dir = ::opendir("/proc/self/task");
+    if (!dir) return delays;
+    while (dirent* entry = ::readdir(dir)) {
+        if (entry->d_name[0] == '.') continue;
+        std::ifstream in(std::string("/proc/self/task/") + entry->d_name + "/schedstat");
+        uint64_t run = 0, wait = 0;
+        if (in >> run >> wait) delays.push_back({std::atol(entry->d_name), wait});
+    }
+    ::closedir(dir);
+    std::sort(delays.begin(), delays.end());
+    return delays;
+}
+
+class PressureGovernor {
+    std::atomic<int> active;
+    int max_workers;
+    std::atomic<bool> stop{false};
+    std::thread monitor;
+
+public:
+    // Pressure is measured per one-second interval from the cumulative totals.
+    // CPU "some" also counts our own workers queueing, behind other tasks or
+    // each other, so their summed runqueue wait is taken out of it. Stalls of
+    // other tasks that overlap ours are missed that way, but idle-priority
+    // workers hardly delay anyone, so those come from contention we do not add
+    // to. I/O uses "full", which needs every non-idle task stalled at once.
+    PressureGovernor(int workers, bool verbose) : active(workers), max_workers(workers) {
+        if (psi_total_us("/proc/pressure/cpu", "some") < 0.0) {
+            if (verbose)
+                std::cout << "Background: no PSI support, running " << workers << " idle-priority workers" << std::endl;
+            return;
+        }
+        monitor = std::thread([this, verbose] {
+            double cpu_before = psi_total_us("/proc/pressure/cpu", "some");
+            double io_before = psi_total_us("/proc/pressure/io", "full");
+            auto delays_before = own_run_delays();
+            Timer interval;
+            while (!stop) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                double cpu = psi_total_us("/proc/pressure/cpu", "some");
+                double io = psi_total_us("/proc/pressure/io", "full");
+                auto delays = own_run_delays();
+                double elapsed_us = std::max(interval.elapsed(), 1e-3) * 1e6;
+                interval = Timer();
+
+                double own_wait_us = 0.0;
+                for (const auto& d : delays) {
+                    auto prev = std::lower_bound(delays_before.begin(), delays_before.end(),
+                                                 std::make_pair(d.first, uint64_t(0)));
+                    if (prev != delays_before.end() && prev->first == d.first && d.second >= prev->second)
+                        own_wait_us += (d.second - prev->second) / 1e3;
+                }
+                double cpu_pct = std::max(0.0, cpu - cpu_before - own_wait_us) * 100.0 / elapsed_us;
+                double io_pct = io >= 0.0 && io_before >= 0.0 ? (io - io_before) * 100.0 / elapsed_us : 0.0;
+                double pressure = std::max(cpu_pct, io_pct);
+                cpu_before = cpu;
+                io_before = io;
+                delays_before = std::move(delays);
+
+                int n = active;
+                if (pressure > PSI_SHRINK_PCT && n > 1) n--;
+                else if (pressure < PSI_GROW_PCT && n < max_workers) n++;
+                if (n != active && verbose)
+                    std::cout << "\nBackground: " << n << " workers active (pressure " << pressure << "%)" << std::endl;
+                active = n;
+            }
+        });
+    }
+    ~PressureGovernor() {
+        stop = true;
+        if (monitor.joinable()) monitor.join();
+    }
+
+    // Parks worker `id` while it is outside the active set; worker 0 always runs
+    void wait_turn(int id, const std::atomic<bool>& failed) const {
+        while (id >= active && !failed && !stop) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+};
+
+// --- Energy Counters ---
+// Package energy from Linux powercap/RAPL: one intel-rapl:N zone per socket
+// (AMD parts use the same driver); its subzones are parts of the package and
+// are not added again. Counters wrap at max_energy_range_uj and are root-only
+// on recent kernels, so a missing or unreadable zone is simply left out and
+// with none left nothing is reported. The package counts every process on it.
+class EnergyMeter {
+    struct Zone {
+        std::string path;
+        uint64_t range = 0;
+        uint64_t last = 0;
+        double joules = 0.0;
+    };
+    std::vector<Zone> zones;
+    std::vector<std::pair<std::string, double>> stages;
+    double marked = 0.0;
+
+    static bool read_counter(const std::string& path, uint64_t& value) {
+        std::ifstream in(path);
+        return static_cast<bool>(in >> value);
+    }
+
+    double total() {
+        double sum = 0.0;
+        for (auto& z : zones) {
+            uint64_t now = 0;
+            if (!read_counter(z.path + "/energy_uj", now)) continue;
+            uint64_t delta = now >= z.last ? now - z.last : z.range - z.last + now;
+            z.joules += delta / 1e6;
+            z.last = now;
+            sum += z.joules;
+        }
+        return sum;
+    }
+
+public:
+    EnergyMeter() {
+        const std::string base = "/sys/class/powercap";
+        DIR* dir = ::opendir(base.c_str());
+        if (!dir) return;
+        while (dirent* entry = ::readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.compare(0, 11, "intel-rapl:") != 0 || name.find(':', 11) != std::string::npos) continue;
+            Zone z;
+            z.path = base + "/" + name;
+            if (!read_counter(z.path + "/energy_uj", z.last) || !read_counter(z.path + "/max_energy_range_uj", z.range))
+                continue;
+            zones.push_back(z);
+        }
+        ::closedir(dir);
+    }
+
+    bool available() const { return !zones.empty(); }
+
+    // Closes the stage that ran since the previous mark
+    void mark(const std::string& stage) {
+        if (!available()) return;
+        double now = total();
+        stages.push_back({stage, now - marked});
+        marked = now;
+    }
+
+    // Joules over all marked stages
+    double joules() const {
+        double sum = 0.0;
+        for (const auto& st : stages) sum += st.second;
+        return sum;
+    }
+
+    // Total, per GB of `bytes` and per stage; silent without counters
+    void report(uint64_t bytes, std::ostream& os = std::cout) const {
+        if (!available()) return;
+        double sum = joules();
+        std::ios::fmtflags flags = os.flags();
+        os << std::fixed << std::setprecision(1) << "Energy: " << sum << " J";
+        if (bytes) os << ", " << sum / (bytes / 1e9) << " J/GB";
+        os << " (" << zones.size() << " RAPL package zones";
+        for (const auto& st : stages) os << ", " << st.first << " " << st.second << " J";
+        os << ")" << std::endl;
+        os.flags(flags);
+    }
+};
+
+// --- Compression Implementation ---
+// Read-only state shared by all compression workers
+struct CompressContext {
+    CompressOptions opts;
+    bool lossy = false;
+    SafetensorsHeader source;     // Layout of the input file
+    SafetensorsHeader layout;     // Layout of the stored data, after ingest transforms
+    std::vector<int> tensor_bits; // Kept mantissa bits per stored tensor
+    std::vector<ChunkPlan> plan;
+    bool has_layout = false;
+};
+
+// Options that change frame contents for the same input. A previous archive is
+// only reused when this matches.
+uint64_t settings_hash(const CompressContext& ctx, int level) {
+    ByteWriter w;
+    w.put_u32(1); // Frame format version
+    w.put_u32(static_cast<uint32_t>(level));
+    w.put_u8(ctx.lossy);
+    w.put_u8(ctx.opts.downcast_f32);
+    w.put_u8(ctx.opts.permute_rows);
+    w.put_u8(ctx.opts.progressive);
+    return xxh64(w.data().data(), w.data().size(), 0);
+}
+
+// Hash of a raw input chunk together with the layout of the tensors it covers,
+// since rounding, downcast and row permutation all depend on the latter.
+uint64_t chunk_hash(const uint8_t* data, const ChunkPlan& p, const CompressContext& ctx) {
+    ByteWriter w;
+    w.put_u64(p.in_size);
+    if (ctx.has_layout) {
+        std::vector<ChunkSegment> pieces = p.packed;
+        if (pieces.empty()) pieces.push_back({p.in_offset, p.in_size, 0, 0});
+        for (const auto& seg : pieces) {
+            uint64_t end = seg.data_offset + seg.size;
+            if (!p.packed.empty()) w.put_u64(seg.size);
+            for (auto t = tensor_at(ctx.source, seg.data_offset); t != ctx.source.tensors.end() && t->begin < end; ++t) {
+                w.put_str(t->name);
+                w.put_str(t->dtype);
+                for (uint64_t d : t->shape) w.put_u64(d);
+                w.put_u64(t->begin - seg.data_offset);
+                w.put_u64(t->end - seg.data_offset);
+                if (ctx.lossy) w.put_u32(ctx.tensor_bits[t - ctx.source.tensors.begin()]);
+            }
+        }
+    }
+    return xxh64(data, p.in_size, xxh64(w.data().data(), w.data().size(), 0));
+}
+
+// Frames of a previous archive, looked up by input chunk hash
+struct PreviousArchive {
+    int fd = -1;
+    Footer footer;
+    std::vector<std::pair<uint64_t, size_t>> by_hash; // Sorted by hash
+
+    ~PreviousArchive() { if (fd >= 0) ::close(fd); }
+
+    // Returns the logical chunk with this hash and stored size, or -1
+    long find(uint64_t hash, uint64_t raw_size) const {
+        auto it = std::lower_bound(by_hash.begin(), by_hash.end(), std::make_pair(hash, size_t(0)));
+        for (; it != by_hash.end() && it->first == hash; ++it)
+            if (footer.index[it->second].raw_size == raw_size) return static_cast<long>(it->second);
+        return -1;
+    }
+
+    // Copies the compressed frame of chunk i into c
+    void read_frame(size_t i, Chunk& c) const {
+        const ChunkIndexEntry& e = footer.index[i];
+        if (c.comp_data.size() < e.comp_size) c.comp_data.resize(e.comp_size);
+        pread_exact(fd, c.comp_data.data(), e.comp_size, e.file_offset + 2 * sizeof(uint64_t));
+        if (footer.progressive()) {
+            const ChunkIndexEntry& m = footer.mantissa_index[i];
+            if (c.mant_comp.size() < m.comp_size) c.mant_comp.resize(m.comp_size);
+            pread_exact(fd, c.mant_comp.data(), m.comp_size, m.file_offset + 2 * sizeof(uint64_t));
+            c.mantissa_size = m.raw_size;
+            c.mant_comp_size = m.comp_size;
+        }
+        c.raw_size = e.raw_size;
+        c.comp_size = e.comp_size;
+        c.low_bits = i < footer.chunk_low_bits.size() ? footer.chunk_low_bits[i] : 8;
+        c.row_keys.clear();
+    }
+};
+
+// Loads the previous archive's footer; leaves by_hash empty if nothing can be reused
+void open_previous(const std::string& path, uint64_t settings, PreviousArchive& prev, std::ostream& console) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open previous archive: " + path);
+    read_footer(in, get_file_size(in), prev.footer);
+    if (prev.footer.chunk_hashes.empty() || prev.footer.chunk_hashes.size() != prev.footer.index.size()) {
+        console << "Previous archive has no chunk hashes, compressing everything" << std::endl;
+        return;
+    }
+    if (prev.footer.settings_hash != settings) {
+        console << "Previous archive used different options, compressing everything" << std::endl;
+        return;
+    }
+    prev.fd = ::open(path.c_str(), O_RDONLY);
+    if (prev.fd < 0) throw std::runtime_error("Cannot open previous archive: " + path);
+    for (size_t i = 0; i < prev.footer.chunk_hashes.size(); ++i) prev.by_hash.push_back({prev.footer.chunk_hashes[i], i});
+    std::sort(prev.by_hash.begin(), prev.by_hash.end());
+}
+
+// Applies the ingest transforms, shuffle and packing to a freshly read chunk.
+// Returns the size of the payload left in scratch_buffer.
+size_t prepare_chunk(Chunk& c, const ChunkPlan& p, const CompressContext& ctx) {
+    const CompressOptions& opts = ctx.opts;
+
+    // 0. Ingest transforms
+    if (opts.downcast_f32) {
+        downcast_chunk(c.raw_data.data(), c.scratch_buffer.data(), p, ctx.source);
+        std::swap(c.raw_data, c.scratch_buffer);
+        c.raw_size = p.out_size;
+    }
+    c.offset = p.out_offset;
+
+    // 1. Shuffle
+    // Ensure even size for BF16
+    if (c.raw_size % 2 != 0) throw std::runtime_error("Chunk size not even (BF16 alignment error)");
+    c.low_bits = ctx.lossy ? round_chunk(c, ctx.layout, ctx.tensor_bits) : 8;
+    c.row_keys.clear();
+    if (opts.permute_rows) {
+        c.row_segments = row_segments(ctx.layout, c.offset, c.raw_size);
+        permute_rows(c.raw_data.data(), c.scratch_buffer.data(), c.row_segments, c.row_keys);
+    }
+    shuffle_bf16(c.raw_data.data(), c.scratch_buffer.data(), c.raw_size);
+
+    size_t half = c.raw_size / 2;
+    size_t payload_size = 0;
+    if (opts.progressive) {
+        // The exponent LSB stays with the high plane, so sign and exponent decode
+        // without the mantissa frame; the kept mantissa bits are packed on their own
+        uint8_t* low = c.scratch_buffer.data() + half;
+        if (c.mantissa.size() < half) c.mantissa.resize(half);
+        for (size_t i = 0; i < half; ++i) c.mantissa[i] = static_cast<uint8_t>(low[i] << 1);
+        pack_low_plane(c.mantissa.data(), half, c.low_bits - 1);
+        c.mantissa_size = packed_size(half, c.low_bits - 1);
+        pack_low_plane(low, half, 1);
+        payload_size = half + packed_size(half, 1);
+    } else {
+        pack_low_plane(c.scratch_buffer.data() + half, half, c.low_bits);
+        payload_size = half + packed_size(half, c.low_bits);
+    }
+
+    // Row keys travel at the end of the frame so every chunk decodes on its own
+    if (!c.row_keys.empty()) {
+        if (c.scratch_buffer.size() < payload_size + c.row_keys.size())
+            c.scratch_buffer.resize(payload_size + c.row_keys.size());
+        std::memcpy(c.scratch_buffer.data() + payload_size, c.row_keys.data(), c.row_keys.size());
+        payload_size += c.row_keys.size();
+    }
+    return payload_size;
+}
+
+// 2. Compress the prepared payload into comp_data
+void compress_frame(ZSTD_CCtx* cctx, Chunk& c, size_t payload_size, int level) {
+    if (c.comp_data.size() < ZSTD_compressBound(payload_size)) c.comp_data.resize(ZSTD_compressBound(payload_size));
+    c.comp_size = ZSTD_compressCCtx(cctx,
+                                    c.comp_data.data(), c.comp_data.size(),
+                                    c.scratch_buffer.data(), payload_size,
+                                    level);
+    if (ZSTD_isError(c.comp_size)) throw std::runtime_error(std::string("ZSTD Error: ") + ZSTD_getErrorName(c.comp_size));
+}
+
+// Progressive: compress the packed mantissa plane into mant_comp
+void compress_mantissa(ZSTD_CCtx* cctx, Chunk& c, int level) {
+    if (c.mant_comp.size() < ZSTD_compressBound(c.mantissa_size)) c.mant_comp.resize(ZSTD_compressBound(c.mantissa_size));
+    c.mant_comp_size = ZSTD_compressCCtx(cctx, c.mant_comp.data(), c.mant_comp.size(),
+                                         c.mantissa.data(), c.mantissa_size, level);
+    if (ZSTD_isError(c.mant_comp_size))
+        throw std::runtime_error(std::string("ZSTD Error: ") + ZSTD_getErrorName(c.mant_comp_size));
+}
+
+// Inline verify: decodes the fresh frames of c while they are still in cache
+// and compares them with the payload they were made from
+void verify_frames(ZSTD_DCtx* dctx, const Chunk& c, size_t payload_size, std::vector<uint8_t>& check) {
+    // One spare byte, so a frame that decodes too long fails as well
+    size_t need = std::max<size_t>(payload_size, c.mantissa_size) + 1;
+    if (check.size() < need) check.resize(need);
+    size_t n = ZSTD_decompressDCtx(dctx, check.data(), payload_size + 1, c.comp_data.data(), c.comp_size);
+    if (ZSTD_isError(n) || n != payload_size || std::memcmp(check.data(), c.scratch_buffer.data(), n) != 0)
+        throw std::runtime_error("Verify failed: frame of the chunk at data offset " + std::to_string(c.offset) +
+                                 " does not decode to its input");
+    if (c.mant_comp_size == 0 || c.mantissa_size == 0) return;
+    n = ZSTD_decompressDCtx(dctx, check.data(), c.mantissa_size + 1, c.mant_comp.data(), c.mant_comp_size);
+    if (ZSTD_isError(n) || n != c.mantissa_size || std::memcmp(check.data(), c.mantissa.data(), n) != 0)
+        throw std::runtime_error("Verify failed: mantissa frame of the chunk at data offset " +
+                                 std::to_string(c.offset) + " does not decode to its input");
+}
+
+// --- Cost-Aware Scheduling ---
+// Predicts how long every planned chunk takes to compress by shuffling and
+// compressing a few small samples of it at `level`. Cost is seconds per byte
+// times the stored chunk size, so both the data and the chunk size count.
+// Samples are taken from the chunk as it will be framed, so a packed chunk is
+// sampled from its gathered pieces.
+std::vector<double> probe_chunk_costs(std::istream& input, uint64_t data_start, const std::vector<ChunkPlan>& plan,
+                                      int level) {
+    std::vector<uint8_t> sample(PROBE_SAMPLE_SIZE), shuffled(PROBE_SAMPLE_SIZE);
+    std::vector<uint8_t> dst(ZSTD_compressBound(PROBE_SAMPLE_SIZE));
+    std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+    std::vector<double> cost(plan.size());
+
+    // Reads `n` bytes at position `pos` of chunk p's frame into dst
+    auto read_frame = [&](const ChunkPlan& p, uint64_t pos, uint8_t* dst, uint64_t n) {
+        auto read = [&](uint64_t offset, uint8_t* to, uint64_t len) {
+            input.seekg(data_start + offset, std::ios::beg);
+            input.read(reinterpret_cast<char*>(to), len);
+            if (input.gcount() != static_cast<std::streamsize>(len)) throw std::runtime_error("Truncated input");
+        };
+        if (p.packed.empty()) return read(p.in_offset + pos, dst, n);
+        for (const auto& seg : p.packed) {
+            uint64_t lo = std::max(pos, seg.frame_offset), hi = std::min(pos + n, seg.frame_offset + seg.size);
+            if (lo < hi) read(seg.data_offset + (lo - seg.frame_offset), dst + (lo - pos), hi - lo);
+        }
+    };
+
+    for (size_t i = 0; i < plan.size(); ++i) {
+        const ChunkPlan& p = plan[i];
+        uint64_t n = std::min<uint64_t>(PROBE_SAMPLE_SIZE, p.in_size) & ~uint64_t(1);
+        double seconds = 0.0;
+        uint64_t bytes = 0;
+        for (int s = 0; s < PROBE_SAMPLES && n > 0; ++s) {
+            uint64_t pos = ((p.in_size - n) * s / (PROBE_SAMPLES - 1)) & ~uint64_t(1);
+            read_frame(p, pos, sample.data(), n);
+            shuffle_bf16(sample.data(), shuffled.data(), n);
+            Timer t;
+            size_t r = ZSTD_compressCCtx(cctx.get(), dst.data(), dst.size(), shuffled.data(), n, level);
+            seconds += t.elapsed();
+            if (ZSTD_isError(r)) throw std::runtime_error(std::string("ZSTD Error: ") + ZSTD_getErrorName(r));
+            bytes += n;
+        }
+        cost[i] = bytes ? p.out_size * seconds / bytes : 0.0;
+    }
+    input.clear();
+    input.seekg(data_start, std::ios::beg);
+    return cost;
+}
+
+// One archive produced by the compressor. A level sweep writes several of them
+// from a single read-and-shuffle pass over the input.
+struct ArchiveOutput {
+    int level = DEFAULT_COMPRESSION_LEVEL;
+    std::string path;
+    std::ofstream file;               // Not opened when only sizes are reported
+    std::vector<ChunkIndexEntry> index;
+    uint64_t size = 0;
+    double compress_seconds = 0.0;    // Time spent in ZSTD at this level, summed over workers
+    TokenBucket* bucket = nullptr;    // Emulated storage, when throttled
+    std::fstream spill;               // Progressive: mantissa frames, copied behind the exponent frames
+    std::string spill_path;
+    uint64_t spill_size = 0;
+    std::vector<ChunkIndexEntry> mantissa_index;
+
+    // A spill file still open here belongs to a failed compression
+    ~ArchiveOutput() {
+        if (!spill.is_open()) return;
+        spill.close();
+        std::remove(spill_path.c_str());
+    }
+
+    void append_spill(const void* data, size_t n) {
+        if (spill.is_open()) spill.write(static_cast<const char*>(data), n);
+        spill_size += n;
+    }
+
+    // Moves the spilled mantissa frames to the end of the archive
+    void flush_spill() {
+        uint64_t base = size;
+        for (auto& e : mantissa_index) e.file_offset += base;
+        if (!spill.is_open()) {
+            size += spill_size;
+            return;
+        }
+        spill.flush();
+        spill.seekg(0, std::ios::beg);
+        std::vector<char> block(4 * 1024 * 1024);
+        for (uint64_t left = spill_size; left > 0;) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(left, block.size()));
+            spill.read(block.data(), n);
+            if (spill.gcount() != static_cast<std::streamsize>(n)) throw std::runtime_error("Spill file truncated");
+            append(block.data(), n);
+            left -= n;
+        }
+        spill.close();
+        std::remove(spill_path.c_str());
+    }
+
+    void append(const void* data, size_t n) {
+        if (!file.is_open()) {
+            size += n;
+            return;
+        }
+        if (bucket) bucket->acquire(n);
+        file.write(static_cast<const char*>(data), n);
+        size += n;
+    }
+};
+
+// "{level}" in the output path is replaced by the level; otherwise ".<level>" is appended
+std::string level_output_path(const std::string& path, int level) {
+    size_t pos = path.find("{level}");
+    if (pos == std::string::npos) return path + "." + std::to_string(level);
+    return path.substr(0, pos) + std::to_string(level) + path.substr(pos + 7);
+}
+
+void compress(const std::string& input_path, const std::string& output_path, const CompressOptions& opts) {
+    // Concurrent compressions (watch --jobs) leave stdout to their caller
+    std::ostream& console = opts.quiet ? null_stream() : std::cout;
+    EnergyMeter energy;
+    std::unique_ptr<TokenBucket> bucket;
+    if (opts.throttle.enabled()) bucket.reset(new TokenBucket(opts.throttle));
+    if (opts.follow && opts.throttle.in_memory) throw std::runtime_error("--follow cannot preload the input");
+    if (opts.follow && opts.schedule_lpt) throw std::runtime_error("--follow reads in file order; drop --schedule lpt");
+    if (opts.follow && opts.pack_small) throw std::runtime_error("--follow reads in file order; drop --pack-small");
+    if (opts.pack_small && (opts.lossy() || opts.downcast_f32 || opts.permute_rows))
+        throw std::runtime_error("--pack-small keeps bytes as stored; it cannot be combined with lossy rounding, "
+                                 "--downcast-f32 or --permute-rows");
+    if (opts.follow) wait_for_size(input_path, 0, opts.follow_timeout);
+    std::unique_ptr<std::istream> input_stream = open_input(input_path, opts.throttle, bucket.get());
+    std::istream& input = *input_stream;
+    if (!input) throw std::runtime_error("File I/O error");
+    bool pytorch_zip = !opts.follow && is_zip_file(input);
+    if (pytorch_zip && (opts.lossy() || opts.downcast_f32 || opts.permute_rows))
+        throw std::runtime_error("PyTorch checkpoints are restored byte for byte; lossy rounding, --downcast-f32 "
+                                 "and --permute-rows do not apply");
+
+    std::vector<int> levels = opts.levels;
+    if (levels.empty()) levels.push_back(opts.level);
+    bool fan_out = opts.levels.size() > 0;
+    if (!opts.reuse_path.empty() && levels.size() > 1) throw std::runtime_error("--reuse needs a single level");
+    if (!opts.reuse_path.empty() && opts.reuse_path == output_path)
+        throw std::runtime_error("--reuse archive must differ from the output");
+    std::vector<ArchiveOutput> outputs(levels.size());
+    for (size_t l = 0; l < levels.size(); ++l) {
+        outputs[l].level = levels[l];
+        outputs[l].path = fan_out ? level_output_path(output_path, levels[l]) : output_path;
+        outputs[l].bucket = bucket.get();
+        if (opts.sizes_only) continue;
+        outputs[l].file.open(outputs[l].path, std::ios::binary);
+        if (!outputs[l].file) throw std::runtime_error("File I/O error");
+        if (opts.progressive) {
+            outputs[l].spill_path = outputs[l].path + ".mantissa.tmp";
+            outputs[l].spill.open(outputs[l].spill_path, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+            if (!outputs[l].spill) throw std::runtime_error("Cannot open spill file for " + outputs[l].path);
+        }
+    }
+
+    uint64_t total_input_size = opts.follow ? 0 : get_file_size(input);
+    int num_threads = omp_get_max_threads();
+    console << "Compressing with " << num_threads << " threads";
+    if (fan_out) console << " at " << levels.size() << " levels in one pass";
+    console << "..." << std::endl;
+
+    // 1. Handle Header (Serial)
+    // A PyTorch zip has none: the whole file is the data region, described by a
+    // layout built from its directory and pickle
+    uint64_t header_size = 0;
+    std::vector<uint8_t> header;
+    SafetensorsHeader zip_layout;
+    if (pytorch_zip) {
+        zip_layout = pytorch_layout(input_path);
+        header = serialize_safetensors_header(zip_layout);
+    } else {
+        if (opts.follow) wait_for_size(input_path, sizeof(header_size), opts.follow_timeout);
+        if (!read_uint64(input, header_size)) throw std::runtime_error("Empty file or missing size");
+
+        header.resize(header_size);
+        if (opts.follow) {
+            wait_for_size(input_path, sizeof(header_size) + header_size, opts.follow_timeout);
+            input.clear();
+            input.seekg(sizeof(header_size), std::ios::beg);
+        }
+        input.read(reinterpret_cast<char*>(header.data()), header_size);
+    }
+    uint64_t data_start = pytorch_zip ? 0 : sizeof(header_size) + header_size;
+
+    // A growing file is as long as its header says it will be
+    if (opts.follow) {
+        SafetensorsHeader st = parse_safetensors_header(header);
+        uint64_t data_end = 0;
+        for (const auto& t : st.tensors) data_end = std::max(data_end, t.end);
+        total_input_size = sizeof(header_size) + header_size + data_end;
+        console << "Following input, expecting " << total_input_size << " bytes" << std::endl;
+    }
+
+    // Lossy, downcast and row-permutation modes need the tensor layout
+    CompressContext ctx;
+    ctx.opts = opts;
+    ctx.lossy = opts.lossy();
+    bool needs_layout = ctx.lossy || opts.downcast_f32 || opts.permute_rows || opts.tensor_chunks || opts.pack_small ||
+                        pytorch_zip;
+    ctx.has_layout = needs_layout;
+    if (needs_layout) {
+        ctx.source = pytorch_zip ? zip_layout : parse_safetensors_header(header);
+        ctx.layout = ctx.source;
+    }
+    if (opts.downcast_f32) {
+        uint64_t converted = 0;
+        ctx.layout = downcast_layout(ctx.source, converted);
+        header = serialize_safetensors_header(ctx.layout);
+        console << "Downcasting " << converted << " F32 tensors to BF16" << std::endl;
+    }
+
+    uint64_t stored_header_size = header.size();
+    for (auto& out : outputs) {
+        out.append(&stored_header_size, sizeof(stored_header_size));
+        out.append(header.data(), stored_header_size);
+    }
+
+    uint64_t processed_bytes = data_start;
+
+    Footer footer;
+    if (pytorch_zip) {
+        footer.source_format = SOURCE_PYTORCH_ZIP;
+        // The shuffle works on byte pairs; an odd last byte is kept in the footer
+        if (total_input_size % 2 != 0) {
+            footer.source_tail.resize(1);
+            input.seekg(total_input_size - 1, std::ios::beg);
+            input.read(reinterpret_cast<char*>(footer.source_tail.data()), 1);
+            input.seekg(0, std::ios::beg);
+            total_input_size -= 1;
+        }
+    }
+    if (ctx.lossy) {
+        for (const auto& t : ctx.layout.tensors) ctx.tensor_bits.push_back(opts.mantissa_bits_for(t.name));
+        footer.lossy = true;
+        footer.default_mantissa_bits = opts.mantissa_bits;
+        footer.rounded.resize(ctx.layout.tensors.size());
+        console << "Lossy mode: keeping " << opts.mantissa_bits << " BF16 mantissa bits ("
+                  << opts.mantissa_overrides.size() << " per-tensor overrides)" << std::endl;
+    }
+
+    uint64_t data_size = total_input_size - processed_bytes;
+    if (opts.pack_small) ctx.plan = plan_packed_chunks(data_size, ctx.source, opts.chunk_size);
+    else ctx.plan = plan_chunks(data_size, needs_layout ? &ctx.source : nullptr, opts.downcast_f32, opts.permute_rows,
+                                opts.tensor_chunks || pytorch_zip, opts.chunk_size);
+    const std::vector<ChunkPlan>& plan = ctx.plan;
+    footer.rows_permuted = opts.permute_rows;
+    size_t packed_chunks = 0, packed_tensors = 0;
+    for (const auto& p : plan) {
+        footer.packed.insert(footer.packed.end(), p.packed.begin(), p.packed.end());
+        packed_chunks += !p.packed.empty();
+    }
+    if (opts.pack_small) {
+        for (const auto& t : ctx.source.tensors) packed_tensors += t.end - t.begin < PACK_TENSOR_LIMIT;
+        console << "Packing " << packed_tensors << " small tensors into " << packed_chunks << " shared frames"
+                  << std::endl;
+    }
+    footer.chunk_hashes.resize(plan.size());
+    for (auto& out : outputs) {
+        out.index.resize(plan.size());
+        if (opts.progressive) out.mantissa_index.resize(plan.size());
+    }
+    if (ctx.lossy) footer.chunk_low_bits.resize(plan.size());
+    uint64_t permuted_rows = 0;
+
+    // Incremental: frames of unchanged chunks are copied from the previous archive
+    PreviousArchive prev;
+    std::vector<std::pair<std::string, TensorRounding>> prev_rounding;
+    if (!opts.reuse_path.empty()) {
+        open_previous(opts.reuse_path, settings_hash(ctx, levels[0]), prev, console);
+        for (const auto& t : prev.footer.rounded) prev_rounding.push_back({t.name, t});
+    }
+    size_t reused_chunks = 0;
+    uint64_t reused_bytes = 0;
+    uint64_t unrounded_values = 0;  // Lossy: values left exact because rounding would break the bound
+    size_t verified_frames = 0;
+    double verify_seconds = 0.0;
+
+    energy.mark("setup");
+
+    // 2. Main Loop
+    // Every worker owns one chunk buffer, pulls the next planned chunk from the
+    // input and appends its frame as soon as it is compressed. The footer index
+    // records where each logical chunk landed, so no worker waits behind a slower
+    // neighbour and no finished chunk is held in memory. In a level sweep the
+    // prepared chunk is compressed once per level and appended to each archive.
+    size_t next_chunk = 0;
+    std::atomic<bool> failed(false);
+    std::string error;
+    Timer timer;
+
+    // Longest-predicted-first: an expensive chunk picked up last no longer
+    // stretches the run; the index hides the order from the decompressor
+    std::vector<size_t> dispatch(plan.size());
+    for (size_t i = 0; i < dispatch.size(); ++i) dispatch[i] = i;
+    if (opts.schedule_lpt) {
+        std::vector<double> cost = probe_chunk_costs(input, data_start, plan, levels[0]);
+        std::stable_sort(dispatch.begin(), dispatch.end(), [&](size_t a, size_t b) { return cost[a] > cost[b]; });
+        console << "Scheduling " << plan.size() << " chunks longest-predicted-first (probe "
+                  << timer.elapsed() << "s)" << std::endl;
+    }
+    // Named critical sections are process-wide; these locks keep concurrent
+    // compress() calls (watch mode) from serialising on each other
+    std::mutex input_mutex, output_mutex, error_mutex;
+
+    std::unique_ptr<PressureGovernor> governor;
+    if (opts.background) governor.reset(new PressureGovernor(num_threads, !opts.quiet));
+    std::atomic<bool> priority_stuck(false);
+
+    #pragma omp parallel
+    {
+        // Kept per thread, so a long-running watcher does not reallocate per file
+        thread_local Chunk c;
+        c.raw_data.resize(CHUNK_SIZE);
+        c.scratch_buffer.resize(CHUNK_SIZE);
+        // Compressed size bound might be larger than input
+        c.comp_data.resize(ZSTD_compressBound(CHUNK_SIZE));
+        std::vector<ZSTD_CCtx*> cctxs(levels.size());
+        for (auto& cctx : cctxs) cctx = ZSTD_createCCtx();
+        ZSTD_DCtx* dctx = opts.verify ? ZSTD_createDCtx() : nullptr;
+        thread_local std::vector<uint8_t> check;
+        ThreadPriority priority;
+        if (governor) priority = lower_thread_priority();
+
+        while (!failed) {
+            if (governor) governor->wait_turn(omp_get_thread_num(), failed);
+            size_t idx = 0;
+            bool have_chunk = false, truncated = false;
+            std::string read_error = "Truncated input";
+
+            // A. Read (Serial)
+            {
+                std::lock_guard<std::mutex> lock(input_mutex);
+                if (!failed && next_chunk < plan.size()) {
+                    idx = dispatch[next_chunk++];
+                    try {
+                        if (opts.schedule_lpt || opts.pack_small) input.seekg(data_start + plan[idx].in_offset);
+                        if (opts.follow) {
+                            uint64_t pos = data_start + plan[idx].in_offset;
+                            wait_for_size(input_path, pos + plan[idx].in_size, opts.follow_timeout);
+                            input.clear();
+                            input.seekg(pos, std::ios::beg);
+                        }
+                        if (c.raw_data.size() < plan[idx].in_size) c.raw_data.resize(plan[idx].in_size);
+                        if (c.scratch_buffer.size() < plan[idx].in_size) c.scratch_buffer.resize(plan[idx].in_size);
+                        if (plan[idx].packed.empty()) {
+                            input.read(reinterpret_cast<char*>(c.raw_data.data()), plan[idx].in_size);
+                            c.raw_size = input.gcount();
+                        } else {
+                            // Packed: gather the pieces in frame order
+                            c.raw_size = 0;
+                            for (const auto& seg : plan[idx].packed) {
+                                input.seekg(data_start + seg.data_offset, std::ios::beg);
+                                input.read(reinterpret_cast<char*>(c.raw_data.data() + seg.frame_offset), seg.size);
+                                c.raw_size += input.gcount();
+                            }
+                        }
+                    } catch (const std::exception& e) {
+                        read_error = e.what();
+                        c.raw_size = 0;
+                    }
+                    have_chunk = (c.raw_size == plan[idx].in_size);
+                    truncated = !have_chunk;
+                }
+            }
+            if (truncated) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (error.empty()) error = read_error;
+                failed = true;
+            }
+            if (!have_chunk) break;
+
+            bool reused = false;
+            try {
+                // B. Process (Parallel)
+                uint64_t hash = chunk_hash(c.raw_data.data(), plan[idx], ctx);
+                footer.chunk_hashes[idx] = hash;
+                long match = prev.by_hash.empty() ? -1 : prev.find(hash, plan[idx].out_size);
+                size_t payload_size = 0;
+                if (match >= 0) {
+                    prev.read_frame(match, c);
+                    c.offset = plan[idx].out_offset;
+                    reused = true;
+                } else {
+                    payload_size = prepare_chunk(c, plan[idx], ctx);
+                }
+
+                for (size_t l = 0; l < levels.size() && !failed; ++l) {
+                    Timer frame_timer;
+                    if (!reused) compress_frame(cctxs[l], c, payload_size, levels[l]);
+                    if (!reused && opts.progressive) compress_mantissa(cctxs[l], c, levels[l]);
+                    double frame_seconds = frame_timer.elapsed();
+                    double check_seconds = 0.0;
+                    if (!reused && dctx) {
+                        Timer check_timer;
+                        verify_frames(dctx, c, payload_size, check);
+                        check_seconds = check_timer.elapsed();
+                    }
+
+                    // C. Append (Serial, any order)
+                    {
+                        std::lock_guard<std::mutex> lock(output_mutex);
+                        ArchiveOutput& out = outputs[l];
+                        ChunkIndexEntry& e = out.index[idx];
+                        e.file_offset = out.size;
+                        e.data_offset = c.offset;
+                        e.raw_size = c.raw_size;
+                        e.comp_size = c.comp_size;
+                        out.append(&c.raw_size, sizeof(c.raw_size));
+                        out.append(&c.comp_size, sizeof(c.comp_size));
+                        out.append(c.comp_data.data(), c.comp_size);
+                        if (opts.progressive) {
+                            ChunkIndexEntry& m = out.mantissa_index[idx];
+                            m.file_offset = out.spill_size;
+                            m.raw_size = c.mantissa_size;
+                            m.comp_size = c.mant_comp_size;
+                            out.append_spill(&c.mantissa_size, sizeof(c.mantissa_size));
+                            out.append_spill(&c.mant_comp_size, sizeof(c.mant_comp_size));
+                            out.append_spill(c.mant_comp.data(), c.mant_comp_size);
+                        }
+                        out.compress_seconds += frame_seconds;
+                        if (dctx) {
+                            verified_frames++;
+                            verify_seconds += check_seconds;
+                        }
+                    }
+                }
+            } catch (const std::exception& e) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (error.empty()) error = e.what();
+                failed = true;
+                break;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                processed_bytes += plan[idx].in_size;
+                permuted_rows += c.row_keys.size();
+                if (reused) {
+                    reused_chunks++;
+                    reused_bytes += plan[idx].in_size;
+                }
+
+                if (ctx.lossy && reused) {
+                    // Per-chunk errors are not stored, so reused chunks carry the previous tensor means
+                    footer.chunk_low_bits[idx] = static_cast<uint8_t>(c.low_bits);
+                    uint64_t chunk_end = c.offset + c.raw_size;
+                    for (auto t = tensor_at(ctx.layout, c.offset); t != ctx.layout.tensors.end() && t->begin < chunk_end; ++t) {
+                        auto p = std::find_if(prev_rounding.begin(), prev_rounding.end(),
+                                              [&](const std::pair<std::string, TensorRounding>& r) { return r.first == t->name; });
+                        if (p == prev_rounding.end()) continue;
+                        uint64_t elements = (std::min(t->end, chunk_end) - std::max(t->begin, c.offset)) / 2;
+                        TensorRounding& r = footer.rounded[t - ctx.layout.tensors.begin()];
+                        r.max_abs_error = std::max(r.max_abs_error, p->second.max_abs_error);
+                        r.sum_abs_error += p->second.sum_abs_error * elements;
+                        r.elements += elements;
+                    }
+                } else if (ctx.lossy) {
+                    footer.chunk_low_bits[idx] = static_cast<uint8_t>(c.low_bits);
+                    for (const auto& r : c.rounding) {
+                        TensorRounding& t = footer.rounded[r.tensor];
+                        t.max_abs_error = std::max(t.max_abs_error, r.max_abs_error);
+                        t.sum_abs_error += r.sum_abs_error;
+                        t.elements += r.elements;
+                        unrounded_values += r.unrounded;
+                    }
+                }
+                if (!opts.quiet) print_progress(processed_bytes, total_input_size);
+            }
+        }
+        for (auto& cctx : cctxs) ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+        if (governor && !restore_thread_priority(priority)) priority_stuck = true;
+    }
+    if (priority_stuck)
+        std::cerr << "Warning: could not restore thread priority (RLIMIT_NICE); later work in this process "
+                     "keeps idle priority" << std::endl;
+    if (failed) throw std::runtime_error(error);
+    processed_bytes += footer.source_tail.size();
+    energy.mark("chunks");
+
+    if (ctx.lossy) {
+        // Keep only the tensors that were actually rounded
+        std::vector<TensorRounding> rounded;
+        double max_err = 0.0, sum_err = 0.0;
+        uint64_t elements = 0;
+        int min_bits = BF16_MANTISSA_BITS;
+        for (size_t i = 0; i < ctx.layout.tensors.size(); ++i) {
+            TensorRounding& t = footer.rounded[i];
+            if (t.elements == 0) continue;
+            t.name = ctx.layout.tensors[i].name;
+            t.mantissa_bits = ctx.tensor_bits[i];
+            max_err = std::max(max_err, t.max_abs_error);
+            sum_err += t.sum_abs_error;
+            elements += t.elements;
+            min_bits = std::min(min_bits, ctx.tensor_bits[i]);
+            rounded.push_back(t);
+        }
+        footer.rounded = std::move(rounded);
+        // Round-to-nearest to k bits is off by at most half a unit in the last kept place
+        footer.relative_error_bound = std::ldexp(1.0, -(min_bits + 1));
+
+        console << "\nRounded " << footer.rounded.size() << " BF16 tensors: relative error <= "
+                  << footer.relative_error_bound << ", max abs error " << max_err
+                  << ", mean abs error " << (elements ? sum_err / elements : 0.0);
+        if (unrounded_values)
+            console << " (" << unrounded_values << " subnormal, Inf/NaN or near-overflow values kept exact)";
+    }
+    if (opts.permute_rows) console << "\nPermuted " << permuted_rows << " rows of 2D BF16 tensors";
+    if (opts.verify) {
+        console << "\nVerified " << verified_frames << " frames in place (" << verify_seconds << "s of decoding";
+        if (!opts.reuse_path.empty()) console << "; reused frames were matched by input hash, not decoded";
+        console << ")";
+    }
+    if (!opts.reuse_path.empty())
+        console << "\nReused " << reused_chunks << " of " << plan.size() << " chunks ("
+                  << reused_bytes / (1024 * 1024) << " MB) from " << opts.reuse_path;
+    for (auto& out : outputs) {
+        if (opts.progressive) out.flush_spill();
+        footer.index = std::move(out.index);
+        footer.mantissa_index = std::move(out.mantissa_index);
+        footer.settings_hash = settings_hash(ctx, out.level);
+        std::vector<uint8_t> bytes = encode_footer(footer);
+        out.append(bytes.data(), bytes.size());
+    }
+    energy.mark("footer");
+
+    double elapsed = timer.elapsed();
+    console << "\nDone in " << elapsed << "s" << std::endl;
+    energy.report(processed_bytes, console);
+    if (bucket) bucket->report("storage", console);
+    if (!fan_out) {
+        console << "Ratio: " << std::fixed << std::setprecision(2) 
+                  << (double)processed_bytes / outputs[0].size << "x" << std::endl;
+        return;
+    }
+
+    // Per-level results; ZSTD time is summed over workers, the rest of the pass
+    // is shared. Energy covers the whole pass too, NA without RAPL counters.
+    std::ofstream csv;
+    std::string pass_j = "NA", pass_j_per_gb = "NA";
+    if (!opts.levels_csv.empty()) {
+        csv.open(opts.levels_csv);
+        if (!csv) throw std::runtime_error("Cannot open output: " + opts.levels_csv);
+        csv << "level,omp_threads,input_mb,final_mb,reduction_pct,zstd_cpu_s,pass_s,compress_j,compress_j_per_gb\n";
+        if (energy.available()) {
+            std::ostringstream j, j_per_gb;
+            j << std::fixed << std::setprecision(1) << energy.joules();
+            j_per_gb << std::fixed << std::setprecision(1) << energy.joules() / (processed_bytes / 1e9);
+            pass_j = j.str();
+            pass_j_per_gb = j_per_gb.str();
+        }
+    }
+    console << std::fixed << std::setprecision(2);
+    console << " level   final_mb   ratio  zstd_cpu_s" << std::endl;
+    for (const auto& out : outputs) {
+        double input_mb = processed_bytes / 1e6, final_mb = out.size / 1e6;
+        console << std::setw(6) << out.level << std::setw(11) << final_mb << std::setw(8)
+                  << (double)processed_bytes / out.size << std::setw(12) << out.compress_seconds << std::endl;
+        if (csv.is_open()) {
+            csv << out.level << "," << num_threads << "," << input_mb << "," << final_mb << ","
+                << 100.0 * (1.0 - final_mb / input_mb) << "," << out.compress_seconds << "," << elapsed << ","
+                << pass_j << "," << pass_j_per_gb << "\n";
+        }
+    }
+}
+
+// --- Decompression Implementation ---
+struct DecompressOptions {
+    bool tensor_times = false;     // Report when every tensor became available
+    std::string tensor_times_csv;  // Optional per-tensor CSV
+    std::string load_order_path;   // Tensor names, one per line; default is header order
+    bool prioritize = false;       // Decode chunks in load order instead of file order
+    int batch_size = BATCH_SIZE;   // Chunks read ahead and decoded per batch
+    ThrottleOptions throttle;
+    std::string approximate;       // Progressive: restore from exponents only, mantissas "zero" or "mid"
+    bool patch = false;            // Progressive: write full mantissas over an existing output in place
+    bool mmap_input = false;       // Decode frames in place from the mapped archive
+    bool mmap_output = false;      // Decode straight into the mapped output file
+    bool non_temporal = false;     // With mmap_output: bypass the cache when storing
+};
+
+// --- Tensor Availability ---
+// A tensor is available once every chunk overlapping it has been written out.
+// The load order defaults to the order of the JSON header, which is the order
+// most loaders walk the state dict in.
+std::vector<size_t> tensor_load_order(const SafetensorsHeader& layout, const std::string& path) {
+    std::vector<size_t> order(layout.tensors.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return layout.tensors[a].key_order < layout.tensors[b].key_order;
+    });
+    if (path.empty()) return order;
+
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("Cannot open load order: " + path);
+    std::vector<size_t> listed;
+    std::vector<bool> seen(layout.tensors.size(), false);
+    std::string name;
+    while (std::getline(in, name)) {
+        if (name.empty()) continue;
+        auto it = std::find_if(layout.tensors.begin(), layout.tensors.end(),
+                               [&](const TensorInfo& t) { return t.name == name; });
+        if (it == layout.tensors.end()) throw std::runtime_error("Unknown tensor in load order: " + name);
+        size_t idx = it - layout.tensors.begin();
+        if (!seen[idx]) listed.push_back(idx);
+        seen[idx] = true;
+    }
+    // Tensors the list does not mention follow in header order
+    for (size_t idx : order)
+        if (!seen[idx]) listed.push_back(idx);
+    return listed;
+}
+
+// Range of segment map entries overlapping [begin, end) of the data region
+std::pair<size_t, size_t> segments_for_range(const std::vector<ChunkSegment>& map, uint64_t begin, uint64_t end) {
+    auto first = std::upper_bound(map.begin(), map.end(), begin,
+                                  [](uint64_t off, const ChunkSegment& s) { return off < s.data_offset + s.size; });
+    auto last = std::lower_bound(first, map.end(), end,
+                                 [](const ChunkSegment& s, uint64_t off) { return s.data_offset < off; });
+    return {static_cast<size_t>(first - map.begin()), static_cast<size_t>(last - map.begin())};
+}
+
+// Chunk order that completes tensors in load order as early as possible
+std::vector<size_t> prioritized_chunk_order(const std::vector<ChunkSegment>& map, size_t chunks,
+                                            const SafetensorsHeader& layout, const std::vector<size_t>& load_order) {
+    std::vector<size_t> order;
+    std::vector<bool> queued(chunks, false);
+    for (size_t t : load_order) {
+        auto range = segments_for_range(map, layout.tensors[t].begin, layout.tensors[t].end);
+        for (size_t s = range.first; s < range.second; ++s) {
+            size_t i = map[s].chunk;
+            if (!queued[i]) order.push_back(i);
+            queued[i] = true;
+        }
+    }
+    for (size_t i = 0; i < chunks; ++i)
+        if (!queued[i]) order.push_back(i);
+    return order;
+}
+
+void report_tensor_times(const std::vector<ChunkSegment>& map, const std::vector<double>& chunk_done,
+                         const SafetensorsHeader& layout, const std::vector<size_t>& load_order,
+                         double header_done, const std::string& csv_path) {
+    std::vector<double> ready(layout.tensors.size(), header_done);
+    for (size_t t = 0; t < layout.tensors.size(); ++t) {
+        auto range = segments_for_range(map, layout.tensors[t].begin, layout.tensors[t].end);
+        for (size_t s = range.first; s < range.second; ++s) ready[t] = std::max(ready[t], chunk_done[map[s].chunk]);
+    }
+
+    std::ofstream csv;
+    if (!csv_path.empty()) {
+        csv.open(csv_path);
+        if (!csv) throw std::runtime_error("Cannot open output: " + csv_path);
+        csv << "load_rank,tensor,bytes,ready_s\n";
+    }
+
+    // Time to the first N% of tensors is the latest ready time within that prefix
+    const int percents[] = {10, 25, 50, 75, 90, 100};
+    size_t next_percent = 0;
+    double prefix_ready = 0.0;
+    size_t n = load_order.size();
+    std::cout << "Tensor availability (" << n << " tensors in load order):" << std::endl;
+    for (size_t rank = 0; rank < n; ++rank) {
+        const TensorInfo& t = layout.tensors[load_order[rank]];
+        prefix_ready = std::max(prefix_ready, ready[load_order[rank]]);
+        if (csv.is_open()) csv << rank << "," << t.name << "," << (t.end - t.begin) << "," << ready[load_order[rank]] << "\n";
+        if (rank == 0) std::cout << "  first tensor: " << prefix_ready << "s (" << t.name << ")" << std::endl;
+        while (next_percent < sizeof(percents) / sizeof(percents[0]) &&
+               (rank + 1) * 100 >= static_cast<size_t>(percents[next_percent]) * n) {
+            std::cout << "  " << std::setw(3) << percents[next_percent] << "% of tensors: " << prefix_ready << "s" << std::endl;
+            next_percent++;
+        }
+    }
+}
+
+// Mantissa fill for an approximate restore; FULL_MANTISSA decodes the stored mantissa frame
+constexpr int FULL_MANTISSA = -1;
+
+// Progressive: rebuilds the low plane behind the high plane from the exponent
+// LSBs that follow it and, unless filling, the separately stored mantissas
+void merge_mantissa(ZSTD_DCtx* dctx, Chunk& c, int fill) {
+    size_t half = c.raw_size / 2;
+    uint8_t* low = c.scratch_buffer.data() + half;
+    uint8_t* exp_bits = c.raw_data.data();
+    unpack_low_plane(low, exp_bits, half, 1);
+    if (fill != FULL_MANTISSA) {
+        for (size_t i = 0; i < half; ++i) low[i] = exp_bits[i] | static_cast<uint8_t>(fill);
+        return;
+    }
+    uint8_t* packed = c.raw_data.data() + half;
+    size_t m_size = ZSTD_decompressDCtx(dctx, packed, half, c.mant_view ? c.mant_view : c.mant_comp.data(),
+                                        c.mant_comp_size);
+    if (ZSTD_isError(m_size)) throw std::runtime_error(std::string("ZSTD Decompress Error: ") + ZSTD_getErrorName(m_size));
+    if (m_size != packed_size(half, c.low_bits - 1)) throw std::runtime_error("Corrupted mantissa frame");
+    unpack_low_plane(packed, low, half, c.low_bits - 1);
+    for (size_t i = 0; i < half; ++i) low[i] = exp_bits[i] | static_cast<uint8_t>(low[i] >> 1);
+}
+
+// Decodes c.comp_data (a frame of c.raw_size logical bytes at c.offset) into
+// c.raw_data, or straight into `out` (a mapped output file) when given
+void decode_chunk(ZSTD_DCtx* dctx, Chunk& c, const Footer& footer, const SafetensorsHeader& layout,
+                  int fill = FULL_MANTISSA, uint8_t* out = nullptr, bool non_temporal = false) {
+    if (c.raw_data.size() < c.raw_size) c.raw_data.resize(c.raw_size);
+    if (c.scratch_buffer.size() < c.raw_size) c.scratch_buffer.resize(c.raw_size);
+
+    size_t half = c.raw_size / 2;
+    size_t shuffled_size = half + packed_size(half, footer.progressive() ? 1 : c.low_bits);
+    size_t key_bytes = 0;
+    if (footer.rows_permuted) {
+        c.row_segments = row_segments(layout, c.offset, c.raw_size);
+        key_bytes = row_key_bytes(c.row_segments);
+        if (c.scratch_buffer.size() < shuffled_size + key_bytes)
+            c.scratch_buffer.resize(shuffled_size + key_bytes);
+    }
+
+    size_t d_size = ZSTD_decompressDCtx(dctx, 
+                                        c.scratch_buffer.data(), shuffled_size + key_bytes, 
+                                        c.comp_view ? c.comp_view : c.comp_data.data(), c.comp_size);
+    if (ZSTD_isError(d_size)) throw std::runtime_error(std::string("ZSTD Decompress Error: ") + ZSTD_getErrorName(d_size));
+
+    c.row_keys.assign(c.scratch_buffer.data() + shuffled_size, c.scratch_buffer.data() + shuffled_size + key_bytes);
+    if (footer.progressive()) {
+        merge_mantissa(dctx, c, fill);
+    } else if (c.low_bits < 8) {
+        // Unpack the low plane into raw_data, then move it back behind the high plane
+        unpack_low_plane(c.scratch_buffer.data() + half, c.raw_data.data(), half, c.low_bits);
+        std::memcpy(c.scratch_buffer.data() + half, c.raw_data.data(), half);
+    }
+    uint8_t* dst = out ? out : c.raw_data.data();
+    if (non_temporal) unshuffle_bf16_nt(c.scratch_buffer.data(), dst, c.raw_size);
+    else unshuffle_bf16(c.scratch_buffer.data(), dst, c.raw_size);
+    if (key_bytes > 0) unpermute_rows(dst, c.scratch_buffer.data(), c.row_segments, c.row_keys.data());
+}
+
+// --- Mapped Output ---
+// The restored file, preallocated and mapped so workers decode straight into
+// it: no staging buffer, no stream buffer copy and no write lock.
+class MappedOutput {
+    int fd = -1;
+    uint8_t* base = nullptr;
+    uint64_t length = 0;
+public:
+    MappedOutput(const std::string& path, uint64_t size, bool keep_existing) : length(size) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | (keep_existing ? 0 : O_TRUNC), 0644);
+        if (fd < 0) throw std::runtime_error("Cannot open output: " + path);
+        // Allocate the blocks up front; running out of space in a mapping is a SIGBUS
+        if (::ftruncate(fd, size) != 0 || (size > 0 && ::posix_fallocate(fd, 0, size) != 0)) {
+            ::close(fd);
+            throw std::runtime_error("Cannot preallocate output: " + path);
+        }
+        if (size > 0) {
+            void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Cannot map output: " + path);
+            }
+            base = static_cast<uint8_t*>(p);
+        }
+    }
+    ~MappedOutput() {
+        if (base) ::munmap(base, length);
+        if (fd >= 0) ::close(fd);
+    }
+    MappedOutput(const MappedOutput&) = delete;
+    MappedOutput& operator=(const MappedOutput&) = delete;
+
+    uint8_t* data() { return base; }
+};
+
+// --- Mapped Input ---
+// The archive mapped read-only, so frames are decoded where they lie in the
+// page cache instead of being copied into per-slot buffers first.
+class MappedInput {
+    int fd = -1;
+    const uint8_t* base = nullptr;
+    uint64_t length = 0;
+public:
+    explicit MappedInput(const std::string& path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Cannot open input: " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot stat input: " + path);
+        }
+        length = st.st_size;
+        if (length > 0) {
+            void* p = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Cannot map input: " + path);
+            }
+            base = static_cast<const uint8_t*>(p);
+        }
+    }
+    ~MappedInput() {
+        if (base) ::munmap(const_cast<uint8_t*>(base), length);
+        if (fd >= 0) ::close(fd);
+    }
+    MappedInput(const MappedInput&) = delete;
+    MappedInput& operator=(const MappedInput&) = delete;
+
+    // Returns the n bytes at offset, checking they lie inside the file
+    const uint8_t* at(uint64_t offset, uint64_t n) const {
+        if (offset > length || n > length - offset) throw std::runtime_error("Truncated compressed data");
+        return base + offset;
+    }
+
+    void advise(uint64_t offset, uint64_t n, int advice) const {
+        if (!base || n == 0 || offset >= length) return;
+        uint64_t page = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+        uint64_t start = offset / page * page;
+        uint64_t end = std::min(length, offset + n);
+        ::madvise(const_cast<uint8_t*>(base) + start, end - start, advice);
+    }
+};
+
+// True when [begin, end) holds only BF16 and F32 tensor bytes, whose low bytes an
+// approximate restore may fill in; anything else (integers, BOOL, F16, bytes
+// outside tensors) must come back exactly
+bool approximable_range(const SafetensorsHeader& layout, uint64_t begin, uint64_t end) {
+    uint64_t pos = begin;
+    for (auto t = tensor_at(layout, begin); t != layout.tensors.end() && pos < end; ++t) {
+        if (t->begin == t->end) continue;
+        if (t->begin > pos || (t->dtype != "BF16" && t->dtype != "F32")) return false;
+        pos = t->end;
+    }
+    return pos >= end;
+}
+
+void decompress(const std::string& input_path, const std::string& output_path, const DecompressOptions& opts) {
+    EnergyMeter energy;
+    Timer timer;
+    std::unique_ptr<TokenBucket> bucket;
+    if (opts.throttle.enabled()) bucket.reset(new TokenBucket(opts.throttle));
+    std::unique_ptr<std::istream> input_stream = open_input(input_path, opts.throttle, bucket.get());
+    std::istream& input = *input_stream;
+    // Patching rewrites the chunks of an existing (approximate) output in place
+    bool in_place = opts.patch && opts.approximate.empty();
+    std::ofstream output;
+    if (!opts.mmap_output)
+        output.open(output_path, in_place ? std::ios::binary | std::ios::in | std::ios::out : std::ios::binary);
+    if (!input || (!opts.mmap_output && !output)) throw std::runtime_error("File I/O error");
+    if (opts.mmap_input && opts.throttle.enabled())
+        throw std::runtime_error("--mmap-input page faults bypass the storage emulation");
+
+    uint64_t total_input_size = get_file_size(input);
+    std::cout << "Decompressing with " << omp_get_max_threads() << " threads..." << std::endl;
+
+    Footer footer;
+    uint64_t chunks_end = read_footer(input, total_input_size, footer);
+    if ((!opts.approximate.empty() || opts.patch) && !footer.progressive())
+        throw std::runtime_error("Archive has no exponent-first layout (compress with --progressive)");
+
+    // Approximate restore: exponents only, then optionally the full mantissas on top
+    std::vector<int> passes;
+    if (opts.approximate == "zero") passes.push_back(0x00);
+    else if (opts.approximate == "mid") passes.push_back(0x40); // Mantissa 0.5, the middle of [1, 2)
+    else if (!opts.approximate.empty()) throw std::runtime_error("--approximate takes zero or mid");
+    if (opts.approximate.empty() || opts.patch) passes.push_back(FULL_MANTISSA);
+    if (footer.lossy) {
+        std::cout << "Lossy archive: " << footer.rounded.size() << " BF16 tensors rounded (default "
+                  << footer.default_mantissa_bits << " mantissa bits, relative error <= "
+                  << footer.relative_error_bound << ")" << std::endl;
+    }
+
+    // 1. Recover Header
+    uint64_t header_size = 0;
+    if (!read_uint64(input, header_size)) throw std::runtime_error("Missing header size");
+    std::vector<uint8_t> header(header_size);
+    input.read(reinterpret_cast<char*>(header.data()), header_size);
+    // A PyTorch checkpoint is the data region itself; its stored header only describes it
+    bool headerless = footer.source_format == SOURCE_PYTORCH_ZIP;
+    if (!opts.mmap_output && !headerless) {
+        write_uint64(output, header_size);
+        output.write(reinterpret_cast<const char*>(header.data()), header_size);
+    }
+
+    double header_done = timer.elapsed();
+
+    bool track_tensors = opts.tensor_times || opts.prioritize;
+    SafetensorsHeader layout;
+    if (footer.rows_permuted || track_tensors || !opts.approximate.empty()) layout = parse_safetensors_header(header);
+
+    // Chunks are looked up through the index, wherever the compressor placed them
+    std::vector<ChunkIndexEntry> index = footer.index;
+    if (index.empty()) index = scan_chunk_stream(input, sizeof(header_size) + header_size, chunks_end);
+    std::vector<ChunkSegment> map = segment_map(index, footer);
+    std::vector<std::vector<ChunkSegment>> scatter(index.size()); // Packed chunks: where their pieces go
+    for (const auto& seg : footer.packed) scatter[seg.chunk].push_back(seg);
+
+    // Approximate passes still decode chunks holding other dtypes in full
+    std::vector<bool> exact(index.size(), false);
+    size_t exact_chunks = 0;
+    uint64_t exact_bytes = 0;
+    if (!opts.approximate.empty()) {
+        for (const auto& seg : map)
+            if (!approximable_range(layout, seg.data_offset, seg.data_offset + seg.size)) exact[seg.chunk] = true;
+        for (size_t i = 0; i < index.size(); ++i) {
+            if (!exact[i]) continue;
+            exact_chunks++;
+            exact_bytes += 2 * sizeof(uint64_t) + footer.mantissa_index.at(i).comp_size;
+        }
+    }
+
+    // Each chunk is written at its own position as soon as it is decoded, so
+    // the processing order is free: file order, or load order when prioritized
+    std::vector<size_t> load_order;
+    if (track_tensors) load_order = tensor_load_order(layout, opts.load_order_path);
+    std::vector<size_t> order(index.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    if (opts.prioritize) order = prioritized_chunk_order(map, index.size(), layout, load_order);
+    std::vector<double> chunk_done(index.size(), 0.0);
+    uint64_t data_start = sizeof(header_size) + header_size;
+    uint64_t out_start = headerless ? 0 : data_start;
+    uint64_t data_end = 0;
+    for (const auto& seg : map) data_end = std::max(data_end, seg.data_offset + seg.size);
+
+    std::unique_ptr<MappedOutput> mapped;
+    if (opts.mmap_output) {
+        mapped.reset(new MappedOutput(output_path, out_start + data_end + footer.source_tail.size(), in_place));
+        if (!headerless) {
+            std::memcpy(mapped->data(), &header_size, sizeof(header_size));
+            std::memcpy(mapped->data() + sizeof(header_size), header.data(), header_size);
+        }
+    }
+
+    std::unique_ptr<MappedInput> mapped_input;
+    if (opts.mmap_input) {
+        mapped_input.reset(new MappedInput(input_path));
+        if (!opts.prioritize) mapped_input->advise(data_start, chunks_end - data_start, MADV_SEQUENTIAL);
+    }
+
+    int batch_size = std::max(1, opts.batch_size);
+    std::vector<Chunk> batch(batch_size);
+    // Pre-allocate decent buffers
+    for(auto& chunk : batch) {
+        if (!mapped_input) chunk.comp_data.resize(ZSTD_compressBound(CHUNK_SIZE));
+        chunk.raw_data.resize(CHUNK_SIZE);
+        chunk.scratch_buffer.resize(CHUNK_SIZE);
+    }
+
+    Timer decode_timer;
+    std::vector<size_t> batch_chunks(batch_size);
+    std::vector<int> batch_fill(batch_size);
+    energy.mark("setup");
+
+    for (int fill : passes) {
+        size_t next_chunk = 0;
+        uint64_t compressed_done = data_start;
+        uint64_t pass_end = chunks_end;
+        if (fill != FULL_MANTISSA && !footer.mantissa_index.empty())
+            pass_end = std::min_element(footer.mantissa_index.begin(), footer.mantissa_index.end(),
+                                        [](const ChunkIndexEntry& a, const ChunkIndexEntry& b) {
+                                            return a.file_offset < b.file_offset;
+                                        })->file_offset;
+
+        while (next_chunk < index.size()) {
+            int chunks_in_batch = 0;
+
+            // Mapped: ask for this batch and the next one, so the kernel reads ahead
+            // while this batch decodes
+            if (mapped_input) {
+                for (size_t n = next_chunk; n < std::min(index.size(), next_chunk + 2 * batch_size); ++n) {
+                    const ChunkIndexEntry& e = index[order[n]];
+                    mapped_input->advise(e.file_offset, 2 * sizeof(uint64_t) + e.comp_size, MADV_WILLNEED);
+                    if (footer.progressive() && (fill == FULL_MANTISSA || exact[order[n]])) {
+                        const ChunkIndexEntry& m = footer.mantissa_index[order[n]];
+                        mapped_input->advise(m.file_offset, 2 * sizeof(uint64_t) + m.comp_size, MADV_WILLNEED);
+                    }
+                }
+            }
+
+            // A. Read Batch Metadata & Data (Serial)
+            for (int i = 0; i < batch_size && next_chunk < index.size(); ++i, ++next_chunk) {
+                size_t idx = order[next_chunk];
+                const ChunkIndexEntry& e = index[idx];
+                Chunk& c = batch[i];
+                batch_chunks[i] = idx;
+                batch_fill[i] = exact[idx] ? FULL_MANTISSA : fill;
+                c.raw_size = e.raw_size;
+                c.comp_size = e.comp_size;
+                c.offset = e.data_offset;
+                c.low_bits = idx < footer.chunk_low_bits.size() ? footer.chunk_low_bits[idx] : 8;
 
-// --- BF16 Logic ---
-void shuffle_bf16(const uint8_t* src, uint8_t* dst, size_t size) {
-    size_t half = size / 2;
-    for (size_t i = 0; i < half; ++i) {
-        dst[i] = src[2 * i + 1];      // High Byte
-        dst[half + i] = src[2 * i];   // Low Byte
+                if (mapped_input) {
+                    c.comp_view = mapped_input->at(e.file_offset + 2 * sizeof(uint64_t), c.comp_size);
+                } else {
+                    // Ensure buffer capacity
+                    if (c.comp_data.size() < c.comp_size) c.comp_data.resize(c.comp_size);
+            
+                    // Read compressed data
+                    input.seekg(e.file_offset + 2 * sizeof(uint64_t), std::ios::beg);
+                    input.read(reinterpret_cast<char*>(c.comp_data.data()), c.comp_size);
+                    if (input.gcount() != static_cast<std::streamsize>(c.comp_size)) 
+                        throw std::runtime_error("Truncated compressed data");
+                }
+
+                compressed_done += 2 * sizeof(uint64_t) + c.comp_size;
+
+                if (footer.progressive() && batch_fill[i] == FULL_MANTISSA && mapped_input) {
+                    const ChunkIndexEntry& m = footer.mantissa_index[idx];
+                    c.mant_comp_size = m.comp_size;
+                    c.mant_view = mapped_input->at(m.file_offset + 2 * sizeof(uint64_t), m.comp_size);
+                    compressed_done += 2 * sizeof(uint64_t) + m.comp_size;
+                } else if (footer.progressive() && batch_fill[i] == FULL_MANTISSA) {
+                    const ChunkIndexEntry& m = footer.mantissa_index[idx];
+                    c.mant_comp_size = m.comp_size;
+                    if (c.mant_comp.size() < m.comp_size) c.mant_comp.resize(m.comp_size);
+                    input.seekg(m.file_offset + 2 * sizeof(uint64_t), std::ios::beg);
+                    input.read(reinterpret_cast<char*>(c.mant_comp.data()), m.comp_size);
+                    if (input.gcount() != static_cast<std::streamsize>(m.comp_size))
+                        throw std::runtime_error("Truncated compressed data");
+                    compressed_done += 2 * sizeof(uint64_t) + m.comp_size;
+                }
+                chunks_in_batch++;
+            }
+
+            // B. Process Batch (Parallel)
+            std::string error;
+            #pragma omp parallel
+            {
+                ZSTD_DCtx* dctx = ZSTD_createDCtx();
+                #pragma omp for schedule(dynamic)
+                for (int i = 0; i < chunks_in_batch; ++i) {
+                    try {
+                        const auto& pieces = scatter[batch_chunks[i]];
+                        if (mapped) {
+                            if (bucket) bucket->acquire(batch[i].raw_size);
+                            if (pieces.empty()) {
+                                decode_chunk(dctx, batch[i], footer, layout, batch_fill[i],
+                                             mapped->data() + out_start + batch[i].offset, opts.non_temporal);
+                            } else {
+                                decode_chunk(dctx, batch[i], footer, layout, batch_fill[i]);
+                                for (const auto& seg : pieces)
+                                    std::memcpy(mapped->data() + out_start + seg.data_offset,
+                                                batch[i].raw_data.data() + seg.frame_offset, seg.size);
+                            }
+                            chunk_done[batch_chunks[i]] = timer.elapsed();
+                            continue;
+                        }
+                        decode_chunk(dctx, batch[i], footer, layout, batch_fill[i]);
+                    } catch (const std::exception& e) {
+                        #pragma omp critical(decompress_error)
+                        {
+                            if (error.empty()) error = e.what();
+                        }
+                        continue;
+                    }
+
+                    // C. Write (Serial, as soon as the chunk is ready)
+                    #pragma omp critical(decompress_output)
+                    {
+                        if (bucket) bucket->acquire(batch[i].raw_size);
+                        const auto& pieces = scatter[batch_chunks[i]];
+                        if (pieces.empty()) {
+                            output.seekp(out_start + batch[i].offset, std::ios::beg);
+                            output.write(reinterpret_cast<const char*>(batch[i].raw_data.data()), batch[i].raw_size);
+                        }
+                        for (const auto& seg : pieces) {
+                            output.seekp(out_start + seg.data_offset, std::ios::beg);
+                            output.write(reinterpret_cast<const char*>(batch[i].raw_data.data() + seg.frame_offset),
+                                         seg.size);
+                        }
+                        chunk_done[batch_chunks[i]] = timer.elapsed();
+                    }
+                }
+                ZSTD_freeDCtx(dctx);
+            }
+            if (!error.empty()) throw std::runtime_error(error);
+            print_progress(std::min(compressed_done, pass_end), fill == FULL_MANTISSA ? chunks_end : pass_end);
+        }
+
+        if (fill != FULL_MANTISSA) {
+            if (!mapped) output.flush();
+            std::cout << "\nApproximate model ready in " << decode_timer.elapsed() << "s from "
+                      << (pass_end - data_start + exact_bytes) / (1024 * 1024) << " of "
+                      << (chunks_end - data_start) / (1024 * 1024) << " MB of frames";
+            if (exact_chunks)
+                std::cout << " (" << exact_chunks << " chunks with non-float data restored exactly)";
+            std::cout << std::endl;
+        }
+        energy.mark(fill == FULL_MANTISSA ? "chunks" : "approximate");
     }
-}
 
-void unshuffle_bf16(const uint8_t* src, uint8_t* dst, size_t size) {
-    size_t half = size / 2;
-    for (size_t i = 0; i < half; ++i) {
-        dst[2 * i + 1] = src[i];      // High Byte
-        dst[2 * i] = src[half + i];   // Low Byte
+    if (!footer.source_tail.empty()) {
+        if (mapped) {
+            std::memcpy(mapped->data() + out_start + data_end, footer.source_tail.data(), footer.source_tail.size());
+        } else {
+            output.seekp(out_start + data_end, std::ios::beg);
+            output.write(reinterpret_cast<const char*>(footer.source_tail.data()), footer.source_tail.size());
+        }
     }
+
+    std::cout << "\nDone in " << decode_timer.elapsed() << "s" << std::endl;
+    energy.report(out_start + data_end + footer.source_tail.size());
+    if (bucket) bucket->report("storage");
+    if (track_tensors)
+        report_tensor_times(map, chunk_done, layout, load_order, header_done, opts.tensor_times_csv);
 }
 
-// --- Data Structure for Parallel Processing ---
-struct Chunk {
-    std::vector<uint8_t> raw_data;
-    std::vector<uint8_t> comp_data;
-    std::vector<uint8_t> scratch_buffer; // For shuffling
-    uint64_t raw_size = 0;
-    uint64_t comp_size = 0;
+// --- Random-Access Reader ---
+// Opens an archive once and serves chunks and byte ranges to any number of
+// threads. After construction the header, footer and index never change and
+// every read is a positioned pread() on the shared descriptor, so there is no
+// stream position to protect and no per-thread file handle.
+struct DecodeScratch {
+    Chunk chunk;
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    DecodeScratch() = default;
+    DecodeScratch(const DecodeScratch&) = delete;
+    DecodeScratch& operator=(const DecodeScratch&) = delete;
+    ~DecodeScratch() { ZSTD_freeDCtx(dctx); }
 };
 
-// --- Compression Implementation ---
-void compress(const std::string& input_path, const std::string& output_path, int level) {
-    std::ifstream input(input_path, std::ios::binary);
-    std::ofstream output(output_path, std::ios::binary);
-    if (!input || !output) throw std::runtime_error("File I/O error");
+class ArchiveReader {
+    int fd = -1;
+    std::vector<uint8_t> header_bytes;
+    SafetensorsHeader st;
+    Footer footer;
+    std::vector<ChunkIndexEntry> index;
+    std::vector<ChunkSegment> map;
+    uint64_t data_start = 0;
 
-    uint64_t total_input_size = get_file_size(input);
-    int num_threads = omp_get_max_threads();
-    std::cout << "Compressing with " << num_threads << " threads (Batch size: " << BATCH_SIZE << ")..." << std::endl;
+public:
+    explicit ArchiveReader(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw std::runtime_error("Cannot open input: " + path);
+        uint64_t file_size = get_file_size(in);
+        uint64_t chunks_end = read_footer(in, file_size, footer);
 
-    // 1. Handle Header (Serial)
-    uint64_t header_size = 0;
-    if (!read_uint64(input, header_size)) throw std::runtime_error("Empty file or missing size");
-    
-    std::vector<uint8_t> header(header_size);
-    input.read(reinterpret_cast<char*>(header.data()), header_size);
-    
-    write_uint64(output, header_size);
-    output.write(reinterpret_cast<const char*>(header.data()), header_size);
+        uint64_t header_size = 0;
+        if (!read_uint64(in, header_size)) throw std::runtime_error("Missing header size");
+        header_bytes.resize(header_size);
+        in.read(reinterpret_cast<char*>(header_bytes.data()), header_size);
+        if (in.gcount() != static_cast<std::streamsize>(header_size)) throw std::runtime_error("Header truncated");
+        st = parse_safetensors_header(header_bytes);
+        data_start = sizeof(header_size) + header_size;
 
-    uint64_t processed_bytes = sizeof(header_size) + header_size;
-    uint64_t total_out_size = processed_bytes;
+        index = footer.index;
+        if (index.empty()) index = scan_chunk_stream(in, data_start, chunks_end);
+        map = segment_map(index, footer);
 
-    // 2. Main Loop
-    std::vector<Chunk> batch(BATCH_SIZE);
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Cannot open input: " + path);
+    }
+    ~ArchiveReader() { if (fd >= 0) ::close(fd); }
+    ArchiveReader(const ArchiveReader&) = delete;
+    ArchiveReader& operator=(const ArchiveReader&) = delete;
+
+    const SafetensorsHeader& layout() const { return st; }
+    const std::vector<ChunkIndexEntry>& chunks() const { return index; }
+    const std::vector<ChunkSegment>& segments() const { return map; }
+    const Footer& info() const { return footer; }
+
+    // Fetches and decodes chunk i into c.raw_data
+    void read_chunk(size_t i, Chunk& c, ZSTD_DCtx* dctx) const {
+        const ChunkIndexEntry& e = index.at(i);
+        c.raw_size = e.raw_size;
+        c.comp_size = e.comp_size;
+        c.offset = e.data_offset;
+        c.low_bits = i < footer.chunk_low_bits.size() ? footer.chunk_low_bits[i] : 8;
+        if (c.comp_data.size() < c.comp_size) c.comp_data.resize(c.comp_size);
+        pread_exact(fd, c.comp_data.data(), c.comp_size, e.file_offset + 2 * sizeof(uint64_t));
+        if (footer.progressive()) {
+            const ChunkIndexEntry& m = footer.mantissa_index.at(i);
+            c.mant_comp_size = m.comp_size;
+            if (c.mant_comp.size() < m.comp_size) c.mant_comp.resize(m.comp_size);
+            pread_exact(fd, c.mant_comp.data(), m.comp_size, m.file_offset + 2 * sizeof(uint64_t));
+        }
+        decode_chunk(dctx, c, footer, st);
+    }
+
+    // Copies [offset, offset + size) of the tensor data region into dst
+    void read_range(uint64_t offset, uint64_t size, uint8_t* dst) const {
+        thread_local DecodeScratch scratch;
+        auto range = segments_for_range(map, offset, offset + size);
+        size_t decoded = index.size();
+        for (size_t s = range.first; s < range.second; ++s) {
+            const ChunkSegment& seg = map[s];
+            if (seg.chunk != decoded) read_chunk(seg.chunk, scratch.chunk, scratch.dctx);
+            decoded = seg.chunk;
+            uint64_t lo = std::max(offset, seg.data_offset);
+            uint64_t hi = std::min(offset + size, seg.data_offset + seg.size);
+            std::memcpy(dst + (lo - offset), scratch.chunk.raw_data.data() + seg.frame_offset + (lo - seg.data_offset),
+                        hi - lo);
+        }
+    }
+
+    std::vector<uint8_t> read_tensor(const TensorInfo& t) const {
+        std::vector<uint8_t> data(t.end - t.begin);
+        read_range(t.begin, data.size(), data.data());
+        return data;
+    }
+};
+
+// --- Tensor Extraction ---
+// Layout of a file holding the tensors matching any of the patterns (all when
+// none are given), packed in their original order; sources[i] is the archive
+// tensor behind subset tensor i
+SafetensorsHeader select_tensors(const SafetensorsHeader& st, const std::vector<std::string>& patterns,
+                                 std::vector<const TensorInfo*>& sources) {
+    SafetensorsHeader subset;
+    subset.metadata = st.metadata;
+    uint64_t offset = 0;
+    for (const auto& t : st.tensors) {
+        bool selected = patterns.empty();
+        for (const auto& p : patterns) selected = selected || fnmatch(p.c_str(), t.name.c_str(), 0) == 0;
+        if (!selected) continue;
+        TensorInfo out = t;
+        out.begin = offset;
+        out.end = offset + (t.end - t.begin);
+        offset = out.end;
+        subset.tensors.push_back(out);
+        sources.push_back(&t);
+    }
+    if (subset.tensors.empty()) throw std::runtime_error("No tensor matches the requested names");
+    return subset;
+}
+
+// Writes the tensors matching any of the patterns (all when none are given) to
+// a new safetensors file. Every needed chunk is fetched and decoded once, by
+// whichever worker picks it up, and its slices are written in place.
+void extract(const std::string& archive_path, const std::string& output_path, const std::vector<std::string>& patterns) {
     Timer timer;
+    ArchiveReader reader(archive_path);
+    const SafetensorsHeader& st = reader.layout();
 
-    // Initialize buffers to avoid repeated allocation
-    for(auto& chunk : batch) {
-        chunk.raw_data.resize(CHUNK_SIZE);
-        chunk.scratch_buffer.resize(CHUNK_SIZE);
-        // Compressed size bound might be larger than input
-        chunk.comp_data.resize(ZSTD_compressBound(CHUNK_SIZE));
+    std::vector<const TensorInfo*> sources;
+    SafetensorsHeader subset = select_tensors(st, patterns, sources);
+    uint64_t offset = subset.tensors.back().end;
+
+    // Group the selected slices, as (tensor, segment), by the chunk that holds them
+    const auto& index = reader.chunks();
+    const auto& map = reader.segments();
+    std::vector<std::vector<std::pair<size_t, size_t>>> chunk_slices(index.size());
+    for (size_t t = 0; t < sources.size(); ++t) {
+        auto range = segments_for_range(map, sources[t]->begin, sources[t]->end);
+        for (size_t s = range.first; s < range.second; ++s) chunk_slices[map[s].chunk].push_back({t, s});
     }
+    std::vector<size_t> needed;
+    for (size_t i = 0; i < index.size(); ++i)
+        if (!chunk_slices[i].empty()) needed.push_back(i);
 
-    bool done = false;
-    while (!done) {
-        int chunks_in_batch = 0;
-
-        // A. Read Batch (Serial)
-        for (int i = 0; i < BATCH_SIZE; ++i) {
-            input.read(reinterpret_cast<char*>(batch[i].raw_data.data()), CHUNK_SIZE);
-            batch[i].raw_size = input.gcount();
-            if (batch[i].raw_size > 0) {
-                chunks_in_batch++;
+    std::vector<uint8_t> header = serialize_safetensors_header(subset);
+    uint64_t header_size = header.size();
+    uint64_t data_start = sizeof(header_size) + header_size;
+    {
+        std::ofstream output(output_path, std::ios::binary);
+        if (!output) throw std::runtime_error("Cannot open output: " + output_path);
+        write_uint64(output, header_size);
+        output.write(reinterpret_cast<const char*>(header.data()), header_size);
+    }
+    int out_fd = ::open(output_path.c_str(), O_WRONLY);
+    if (out_fd < 0) throw std::runtime_error("Cannot open output: " + output_path);
+
+    std::cout << "Extracting " << subset.tensors.size() << " tensors from " << needed.size() << " of "
+              << index.size() << " chunks with " << omp_get_max_threads() << " threads..." << std::endl;
+
+    std::string error;
+    #pragma omp parallel
+    {
+        DecodeScratch scratch;
+        #pragma omp for schedule(dynamic)
+        for (size_t n = 0; n < needed.size(); ++n) {
+            size_t i = needed[n];
+            try {
+                reader.read_chunk(i, scratch.chunk, scratch.dctx);
+                for (const auto& slice : chunk_slices[i]) {
+                    size_t t = slice.first;
+                    const ChunkSegment& seg = map[slice.second];
+                    uint64_t lo = std::max(sources[t]->begin, seg.data_offset);
+                    uint64_t hi = std::min(sources[t]->end, seg.data_offset + seg.size);
+                    uint64_t dst = data_start + subset.tensors[t].begin + (lo - sources[t]->begin);
+                    const uint8_t* src = scratch.chunk.raw_data.data() + seg.frame_offset + (lo - seg.data_offset);
+                    if (::pwrite(out_fd, src, hi - lo, static_cast<off_t>(dst)) != static_cast<ssize_t>(hi - lo))
+                        throw std::runtime_error("Write failed: " + output_path);
+                }
+            } catch (const std::exception& e) {
+                #pragma omp critical(extract_error)
+                {
+                    if (error.empty()) error = e.what();
+                }
             }
-            if (input.eof() || batch[i].raw_size == 0) {
-                done = true;
-                break;
+        }
+    }
+    ::close(out_fd);
+    if (!error.empty()) throw std::runtime_error(error);
+
+    std::cout << "Done in " << timer.elapsed() << "s (" << offset << " tensor bytes)" << std::endl;
+}
+
+// --- Lazy Tensor Loader ---
+// Serves one tensor at a time, the way a model loader walks a state dict, from
+// a small cache of decoded chunks. When requests follow a pattern -- the next
+// tensor in header order, or the same role one layer further on
+// ("layers.3.mlp.up_proj.weight" -> "layers.4.mlp.up_proj.weight") -- the
+// chunks of the next `depth` predicted tensors are decoded ahead on idle
+// workers. A demand read never waits behind prefetches: its chunk goes to the
+// front, and a still-queued prefetch of it is promoted.
+class TensorLoader {
+    struct Slot {
+        std::shared_ptr<std::vector<uint8_t>> data; // Decoded chunk, null when not cached
+        bool queued = false;
+        bool decoding = false;
+        bool prefetched = false;                    // Decoded ahead and not demanded yet
+        uint64_t last_use = 0;
+        std::string error;                          // Failed decode, retried by the next request
+    };
+    struct Role {
+        std::string pattern; // Name with the layer number replaced by '*'
+        long layer = -1;
+    };
+
+    ArchiveReader reader;
+    size_t depth;
+    size_t capacity;
+    std::vector<Slot> slots; // By chunk
+    std::deque<size_t> demand_queue, prefetch_queue;
+    std::mutex mutex;
+    std::condition_variable work_ready, chunk_ready;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    uint64_t clock = 0;
+
+    std::vector<size_t> by_key;  // Tensor indices in header order
+    std::vector<Role> roles;     // By tensor
+    long last_tensor = -1;
+
+public:
+    struct Stats {
+        uint64_t requests = 0;
+        uint64_t chunk_reads = 0;
+        uint64_t ready_hits = 0;     // Chunk already decoded ahead of the request
+        uint64_t inflight_hits = 0;  // Prefetch queued or decoding when demanded
+        uint64_t misses = 0;
+        uint64_t prefetches = 0;
+        uint64_t wasted = 0;         // Prefetched chunks evicted before any use
+        double stall_seconds = 0.0;
+    };
+
+private:
+    Stats stats;
+
+    // "model.layers.12.mlp.up_proj.weight" -> ("model.layers.*.mlp.up_proj.weight", 12)
+    static Role role_of(const std::string& name) {
+        Role r;
+        size_t start = 0;
+        while (start < name.size()) {
+            size_t end = name.find('.', start);
+            if (end == std::string::npos) end = name.size();
+            if (end > start && name.find_first_not_of("0123456789", start) >= end) {
+                r.pattern = name.substr(0, start) + "*" + name.substr(end);
+                r.layer = std::stol(name.substr(start, end - start));
+                return r;
             }
+            start = end + 1;
         }
-        if (chunks_in_batch == 0) break;
+        r.pattern = name;
+        return r;
+    }
 
-        // B. Process Batch (Parallel)
-        #pragma omp parallel for schedule(dynamic)
-        for (int i = 0; i < chunks_in_batch; ++i) {
-            Chunk& c = batch[i];
-            
-            // 1. Shuffle
-            // Ensure even size for BF16
-            if (c.raw_size % 2 != 0) {
-                 // In real app, handle padding. Here we throw.
-                 throw std::runtime_error("Chunk size not even (BF16 alignment error)");
-            }
-            shuffle_bf16(c.raw_data.data(), c.scratch_buffer.data(), c.raw_size);
-
-            // 2. Compress
-            // ZSTD_CCtx is NOT thread-safe, so we use a thread_local one or create one here.
-            // Creating one per chunk is slightly overhead, but safe. 
-            // Ideally, use thread_local ZSTD_CCtx* ctx;
-            ZSTD_CCtx* cctx = ZSTD_createCCtx();
-            ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
-            
-            c.comp_size = ZSTD_compressCCtx(cctx, 
-                                            c.comp_data.data(), c.comp_data.size(), 
-                                            c.scratch_buffer.data(), c.raw_size, 
-                                            level);
-            
-            if (ZSTD_isError(c.comp_size)) {
-                // Cannot throw easily inside OMP, handle gracefully or abort
-                std::cerr << "ZSTD Error: " << ZSTD_getErrorName(c.comp_size) << std::endl;
-                exit(1);
+    // Queues chunk i, or moves it to the demand queue; the caller holds the lock.
+    // A chunk whose decode failed is queued again, so a transient read error
+    // only fails the requests that were waiting for it.
+    void request(size_t i, bool demand) {
+        Slot& s = slots[i];
+        s.last_use = ++clock;
+        if (s.data || s.decoding) return;
+        s.error.clear();
+        if (s.queued) {
+            if (!demand) return;
+            auto it = std::find(prefetch_queue.begin(), prefetch_queue.end(), i);
+            if (it == prefetch_queue.end()) return;
+            prefetch_queue.erase(it);
+        } else if (!demand) {
+            stats.prefetches++;
+        }
+        s.queued = true;
+        s.prefetched = !demand;
+        (demand ? demand_queue : prefetch_queue).push_back(i);
+        work_ready.notify_one();
+    }
+
+    // Drops least recently used chunks beyond the capacity; the caller holds the lock
+    void evict() {
+        size_t cached = 0;
+        for (const auto& s : slots) cached += s.data != nullptr;
+        while (cached > capacity) {
+            Slot* oldest = nullptr;
+            for (auto& s : slots)
+                if (s.data && (!oldest || s.last_use < oldest->last_use)) oldest = &s;
+            if (oldest->prefetched) stats.wasted++;
+            oldest->data.reset();
+            oldest->prefetched = false;
+            cached--;
+        }
+    }
+
+    void work() {
+        DecodeScratch scratch;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_ready.wait(lock, [&] { return stopping || !demand_queue.empty() || !prefetch_queue.empty(); });
+            if (stopping) return;
+            std::deque<size_t>& queue = demand_queue.empty() ? prefetch_queue : demand_queue;
+            size_t i = queue.front();
+            queue.pop_front();
+            slots[i].queued = false;
+            slots[i].decoding = true;
+            stats.chunk_reads++;
+            lock.unlock();
+
+            std::shared_ptr<std::vector<uint8_t>> data;
+            std::string error;
+            try {
+                reader.read_chunk(i, scratch.chunk, scratch.dctx);
+                data = std::make_shared<std::vector<uint8_t>>(scratch.chunk.raw_data.begin(),
+                                                               scratch.chunk.raw_data.begin() + scratch.chunk.raw_size);
+            } catch (const std::exception& e) {
+                error = e.what();
             }
-            ZSTD_freeCCtx(cctx);
+
+            lock.lock();
+            slots[i].decoding = false;
+            slots[i].data = data;
+            slots[i].error = error;
+            evict();
+            chunk_ready.notify_all();
         }
+    }
 
-        // C. Write Batch (Serial)
-        for (int i = 0; i < chunks_in_batch; ++i) {
-            write_uint64(output, batch[i].raw_size);
-            write_uint64(output, batch[i].comp_size);
-            output.write(reinterpret_cast<const char*>(batch[i].comp_data.data()), batch[i].comp_size);
+    // The next `depth` tensors the current pattern points at
+    std::vector<size_t> predict(size_t t) const {
+        std::vector<size_t> next;
+        const auto& tensors = reader.layout().tensors;
+        if (last_tensor < 0) return next;
+        const Role& now = roles[t];
+        const Role& before = roles[last_tensor];
+        if (now.layer >= 0 && now.pattern == before.pattern && now.layer == before.layer + 1) {
+            for (long layer = now.layer + 1; next.size() < depth; ++layer) {
+                auto it = std::find_if(roles.begin(), roles.end(), [&](const Role& r) {
+                    return r.layer == layer && r.pattern == now.pattern;
+                });
+                if (it == roles.end()) break;
+                next.push_back(it - roles.begin());
+            }
+        } else if (tensors[t].key_order == tensors[last_tensor].key_order + 1) {
+            for (size_t k = tensors[t].key_order + 1; k < by_key.size() && next.size() < depth; ++k)
+                next.push_back(by_key[k]);
+        }
+        return next;
+    }
 
-            processed_bytes += batch[i].raw_size;
-            total_out_size += (16 + batch[i].comp_size);
+public:
+    TensorLoader(const std::string& path, int threads, size_t depth)
+        : reader(path), depth(depth), slots(reader.chunks().size()) {
+        const auto& tensors = reader.layout().tensors;
+        by_key.resize(tensors.size());
+        for (size_t i = 0; i < tensors.size(); ++i) {
+            by_key[tensors[i].key_order] = i;
+            roles.push_back(role_of(tensors[i].name));
         }
+        // Room for the tensor being read, everything predicted and one chunk per worker
+        capacity = 2 + 2 * depth + threads;
+        for (int i = 0; i < threads; ++i) workers.emplace_back(&TensorLoader::work, this);
+    }
 
-        print_progress(processed_bytes, total_input_size);
+    ~TensorLoader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto& w : workers) w.join();
     }
 
-    std::cout << "\nDone in " << timer.elapsed() << "s" << std::endl;
-    std::cout << "Ratio: " << std::fixed << std::setprecision(2) 
-              << (double)processed_bytes / total_out_size << "x" << std::endl;
-}
+    const SafetensorsHeader& layout() const { return reader.layout(); }
+    Stats statistics() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
 
-// --- Decompression Implementation ---
-void decompress(const std::string& input_path, const std::string& output_path) {
-    std::ifstream input(input_path, std::ios::binary);
-    std::ofstream output(output_path, std::ios::binary);
-    if (!input || !output) throw std::runtime_error("File I/O error");
+    // Tensor t of the layout, decoded
+    std::vector<uint8_t> load(size_t t) {
+        const TensorInfo& info = reader.layout().tensors.at(t);
+        std::vector<uint8_t> out(info.end - info.begin);
+        const auto& map = reader.segments();
+        auto range = segments_for_range(map, info.begin, info.end);
 
-    uint64_t total_input_size = get_file_size(input);
-    std::cout << "Decompressing with " << omp_get_max_threads() << " threads..." << std::endl;
+        std::unique_lock<std::mutex> lock(mutex);
+        stats.requests++;
+        for (size_t s = range.first; s < range.second; ++s) {
+            Slot& slot = slots[map[s].chunk];
+            if (slot.data && slot.prefetched) stats.ready_hits++;
+            else if (slot.queued || slot.decoding) stats.inflight_hits++;
+            else if (!slot.data) stats.misses++;
+            slot.prefetched = false;
+            request(map[s].chunk, true);
+        }
+        for (size_t next : predict(t)) {
+            auto ahead = segments_for_range(map, reader.layout().tensors[next].begin, reader.layout().tensors[next].end);
+            for (size_t s = ahead.first; s < ahead.second; ++s) request(map[s].chunk, false);
+        }
+        last_tensor = static_cast<long>(t);
 
-    // 1. Recover Header
-    uint64_t header_size = 0;
-    if (!read_uint64(input, header_size)) throw std::runtime_error("Missing header size");
-    std::vector<uint8_t> header(header_size);
-    input.read(reinterpret_cast<char*>(header.data()), header_size);
+        for (size_t s = range.first; s < range.second; ++s) {
+            const ChunkSegment& seg = map[s];
+            Slot& slot = slots[seg.chunk];
+            Timer stall;
+            // An eviction between decode and wake-up just queues the chunk again
+            while (!slot.data && slot.error.empty()) {
+                if (!slot.queued && !slot.decoding) request(seg.chunk, true);
+                chunk_ready.wait(lock);
+            }
+            stats.stall_seconds += stall.elapsed();
+            if (!slot.error.empty()) throw std::runtime_error(slot.error);
+            std::shared_ptr<std::vector<uint8_t>> data = slot.data;
+            slot.last_use = ++clock;
+            lock.unlock();
+            uint64_t lo = std::max(info.begin, seg.data_offset);
+            uint64_t hi = std::min(info.end, seg.data_offset + seg.size);
+            std::memcpy(out.data() + (lo - info.begin), data->data() + seg.frame_offset + (lo - seg.data_offset), hi - lo);
+            lock.lock();
+        }
+        return out;
+    }
+};
+
+// Loads tensors one by one in load order through the lazy loader, as a model
+// loader would, writes them out and reports how long requests stalled
+void load(const std::string& archive_path, const std::string& output_path, const std::vector<std::string>& patterns,
+          const std::string& load_order_path, int prefetch) {
+    Timer timer;
+    TensorLoader loader(archive_path, omp_get_max_threads(), prefetch);
+    const SafetensorsHeader& st = loader.layout();
+    std::vector<const TensorInfo*> sources;
+    SafetensorsHeader subset = select_tensors(st, patterns, sources);
+
+    std::vector<uint8_t> header = serialize_safetensors_header(subset);
+    uint64_t header_size = header.size();
+    uint64_t data_start = sizeof(header_size) + header_size;
+    std::ofstream output(output_path, std::ios::binary);
+    if (!output) throw std::runtime_error("Cannot open output: " + output_path);
     write_uint64(output, header_size);
     output.write(reinterpret_cast<const char*>(header.data()), header_size);
 
-    std::vector<Chunk> batch(BATCH_SIZE);
-    // Pre-allocate decent buffers
-    for(auto& chunk : batch) {
-        chunk.comp_data.resize(ZSTD_compressBound(CHUNK_SIZE)); 
-        chunk.raw_data.resize(CHUNK_SIZE);
-        chunk.scratch_buffer.resize(CHUNK_SIZE);
+    std::cout << "Loading " << subset.tensors.size() << " tensors with " << omp_get_max_threads()
+              << " workers, prefetch depth " << prefetch << "..." << std::endl;
+    for (size_t t : tensor_load_order(st, load_order_path)) {
+        auto it = std::find(sources.begin(), sources.end(), &st.tensors[t]);
+        if (it == sources.end()) continue;
+        std::vector<uint8_t> data = loader.load(t);
+        output.seekp(data_start + subset.tensors[it - sources.begin()].begin, std::ios::beg);
+        output.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+    if (!output) throw std::runtime_error("Write failed: " + output_path);
+
+    TensorLoader::Stats stats = loader.statistics();
+    std::cout << "Done in " << timer.elapsed() << "s, stalled " << stats.stall_seconds << "s on " << stats.requests
+              << " requests" << std::endl;
+    std::cout << "Chunks: " << stats.chunk_reads << " decoded, " << stats.prefetches << " prefetched ("
+              << stats.ready_hits << " ready, " << stats.inflight_hits << " in flight, " << stats.wasted
+              << " unused), " << stats.misses << " demand misses" << std::endl;
+}
+
+// --- Watch Mode ---
+// Long-running: every *.safetensors file closed after writing (or renamed) into
+// the watched directory is compressed by one of `jobs` workers, which share the
+// OpenMP threads. The archive is written to <name>.zst.tmp, synced and renamed,
+// so readers of the output directory never see a partial archive.
+std::atomic<bool> watch_stop(false);
+
+void on_watch_signal(int) { watch_stop = true; }
+
+bool has_suffix(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+void publish_archive(const std::string& input_path, const std::string& final_path, const CompressOptions& opts) {
+    std::string tmp_path = final_path + ".tmp";
+    try {
+        compress(input_path, tmp_path, opts);
+        int fd = ::open(tmp_path.c_str(), O_RDONLY);
+        if (fd < 0 || ::fsync(fd) != 0) {
+            if (fd >= 0) ::close(fd);
+            throw std::runtime_error("Cannot sync " + tmp_path);
+        }
+        ::close(fd);
+        if (std::rename(tmp_path.c_str(), final_path.c_str()) != 0)
+            throw std::runtime_error("Cannot publish " + final_path);
+    } catch (...) {
+        std::remove(tmp_path.c_str());
+        throw;
+    }
+}
+
+void watch(const std::string& dir, const std::string& out_dir, CompressOptions opts, int jobs) {
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0) throw std::runtime_error("inotify unavailable");
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        ::close(fd);
+        throw std::runtime_error("Cannot watch directory: " + dir);
     }
+    std::signal(SIGINT, on_watch_signal);
+    std::signal(SIGTERM, on_watch_signal);
+
+    opts.quiet = jobs > 1;
+    int threads_per_job = std::max(1, omp_get_max_threads() / jobs);
+    std::cout << "Watching " << dir << " with " << jobs << " jobs of " << threads_per_job
+              << " threads, publishing to " << out_dir << std::endl;
 
+    std::deque<std::string> pending;
+    std::mutex mutex;
+    std::condition_variable ready;
     bool done = false;
-    Timer timer;
 
-    while (!done) {
-        int chunks_in_batch = 0;
+    std::vector<std::thread> workers;
+    for (int j = 0; j < jobs; ++j) {
+        workers.emplace_back([&] {
+            omp_set_num_threads(threads_per_job);
+            for (;;) {
+                std::string name;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [&] { return done || !pending.empty(); });
+                    if (pending.empty()) return;
+                    name = pending.front();
+                    pending.pop_front();
+                }
+                std::string input_path = dir + "/" + name;
+                std::string final_path = out_dir + "/" + name + ".zst";
+                Timer timer;
+                try {
+                    publish_archive(input_path, final_path, opts);
+                    struct stat in_st, out_st;
+                    bool sized = ::stat(input_path.c_str(), &in_st) == 0 && ::stat(final_path.c_str(), &out_st) == 0;
+                    // The only stdout line of a job when several run (compress is quiet then)
+                    std::lock_guard<std::mutex> lock(mutex);
+                    std::ios::fmtflags flags = std::cout.flags();
+                    std::cout << std::fixed << std::setprecision(2) << "Published " << final_path;
+                    if (sized && out_st.st_size > 0)
+                        std::cout << " (" << in_st.st_size / (1024 * 1024) << " -> " << out_st.st_size / (1024 * 1024)
+                                  << " MB, ratio " << static_cast<double>(in_st.st_size) / out_st.st_size << "x)";
+                    std::cout << " in " << timer.elapsed() << "s" << std::endl;
+                    std::cout.flags(flags);
+                } catch (const std::exception& e) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    std::cerr << "Failed " << input_path << ": " << e.what() << std::endl;
+                }
+            }
+        });
+    }
+
+    std::vector<char> buffer(64 * 1024);
+    while (!watch_stop) {
+        pollfd p = {fd, POLLIN, 0};
+        if (::poll(&p, 1, 500) <= 0) continue;
+        ssize_t n = ::read(fd, buffer.data(), buffer.size());
+        for (ssize_t pos = 0; pos < n;) {
+            const inotify_event* ev = reinterpret_cast<const inotify_event*>(buffer.data() + pos);
+            pos += sizeof(inotify_event) + ev->len;
+            if (ev->len == 0 || (ev->mask & IN_ISDIR)) continue;
+            std::string name = ev->name;
+            if (!has_suffix(name, ".safetensors")) continue;
+            std::lock_guard<std::mutex> lock(mutex);
+            // A writer that reopens the file closes it again; compress it once
+            if (std::find(pending.begin(), pending.end(), name) == pending.end()) pending.push_back(name);
+            ready.notify_one();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cout << "Stopping, finishing " << pending.size() << " queued files..." << std::endl;
+        done = true;
+    }
+    ready.notify_all();
+    for (auto& w : workers) w.join();
+    ::close(fd);
+}
 
-        // A. Read Batch Metadata & Data (Serial)
-        for (int i = 0; i < BATCH_SIZE; ++i) {
-            if (!read_uint64(input, batch[i].raw_size)) {
-                done = true; 
-                break;
+// --- In-Memory Batch API ---
+// For many small BF16 buffers (a parameter server's tensors), where the file
+// path with its 32MB chunks is the wrong shape. Consecutive buffers are packed
+// into groups of about BATCH_GROUP_SIZE bytes so the frame overhead is paid
+// per group; each group is shuffled and compressed as one frame and groups run
+// across the worker pool. Contexts and scratch belong to the codec and are
+// reused from call to call.
+//
+// Blob: [u64 count][count x u64 size][u64 groups][groups x (u64 first, u64 buffers,
+//       u64 raw_size, u64 comp_size)][frames]
+constexpr size_t BATCH_GROUP_SIZE = 256 * 1024;
+
+struct ConstSpan {
+    const uint8_t* data;
+    size_t size;
+};
+
+struct MutableSpan {
+    uint8_t* data;
+    size_t size;
+};
+
+class BatchCodec {
+    struct Worker {
+        ZSTD_CCtx* cctx = ZSTD_createCCtx();
+        ZSTD_DCtx* dctx = ZSTD_createDCtx();
+        std::vector<uint8_t> packed;
+        std::vector<uint8_t> shuffled;
+        ~Worker() {
+            ZSTD_freeCCtx(cctx);
+            ZSTD_freeDCtx(dctx);
+        }
+    };
+    struct Group {
+        uint64_t first = 0, buffers = 0, raw_size = 0, comp_size = 0;
+    };
+
+    int level;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<uint8_t> staging;
+
+    void ensure_workers() {
+        while (workers.size() < static_cast<size_t>(omp_get_max_threads())) workers.emplace_back(new Worker());
+    }
+
+    static void grow(std::vector<uint8_t>& v, size_t n) {
+        if (v.size() < n) v.resize(n);
+    }
+
+public:
+    explicit BatchCodec(int level = DEFAULT_COMPRESSION_LEVEL) : level(level) {}
+
+    void compress(const std::vector<ConstSpan>& in, std::vector<uint8_t>& out) {
+        std::vector<Group> groups;
+        for (size_t i = 0; i < in.size(); ++i) {
+            if (in[i].size % 2 != 0) throw std::runtime_error("Buffer size not even (BF16 alignment error)");
+            if (groups.empty() || (groups.back().buffers > 0 && groups.back().raw_size + in[i].size > BATCH_GROUP_SIZE)) {
+                groups.emplace_back();
+                groups.back().first = i;
             }
-            if (!read_uint64(input, batch[i].comp_size)) throw std::runtime_error("Corrupted chunk header");
+            groups.back().buffers++;
+            groups.back().raw_size += in[i].size;
+        }
 
-            // Ensure buffer capacity
-            if (batch[i].comp_data.size() < batch[i].comp_size) 
-                batch[i].comp_data.resize(batch[i].comp_size);
-            
-            // Read compressed data
-            input.read(reinterpret_cast<char*>(batch[i].comp_data.data()), batch[i].comp_size);
-            if (input.gcount() != static_cast<std::streamsize>(batch[i].comp_size)) 
-                throw std::runtime_error("Truncated compressed data");
-            
-            chunks_in_batch++;
+        std::vector<size_t> bound(groups.size() + 1, 0);
+        for (size_t g = 0; g < groups.size(); ++g) bound[g + 1] = bound[g] + ZSTD_compressBound(groups[g].raw_size);
+        grow(staging, bound.back());
+        ensure_workers();
+
+        std::string error;
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t g = 0; g < groups.size(); ++g) {
+            Worker& w = *workers[omp_get_thread_num()];
+            Group& grp = groups[g];
+            grow(w.packed, grp.raw_size);
+            grow(w.shuffled, grp.raw_size);
+            size_t pos = 0;
+            for (uint64_t i = grp.first; i < grp.first + grp.buffers; ++i) {
+                std::memcpy(w.packed.data() + pos, in[i].data, in[i].size);
+                pos += in[i].size;
+            }
+            shuffle_bf16(w.packed.data(), w.shuffled.data(), grp.raw_size);
+            size_t n = ZSTD_compressCCtx(w.cctx, staging.data() + bound[g], bound[g + 1] - bound[g],
+                                         w.shuffled.data(), grp.raw_size, level);
+            if (ZSTD_isError(n)) {
+                #pragma omp critical(batch_error)
+                {
+                    if (error.empty()) error = std::string("ZSTD Error: ") + ZSTD_getErrorName(n);
+                }
+                continue;
+            }
+            grp.comp_size = n;
+        }
+        if (!error.empty()) throw std::runtime_error(error);
+
+        ByteWriter header;
+        header.put_u64(in.size());
+        for (const auto& span : in) header.put_u64(span.size);
+        header.put_u64(groups.size());
+        size_t total = header.data().size() + groups.size() * 4 * sizeof(uint64_t);
+        for (const auto& grp : groups) {
+            header.put_u64(grp.first);
+            header.put_u64(grp.buffers);
+            header.put_u64(grp.raw_size);
+            header.put_u64(grp.comp_size);
+            total += grp.comp_size;
+        }
+        out.resize(total);
+        std::memcpy(out.data(), header.data().data(), header.data().size());
+        size_t pos = header.data().size();
+        for (size_t g = 0; g < groups.size(); ++g) {
+            std::memcpy(out.data() + pos, staging.data() + bound[g], groups[g].comp_size);
+            pos += groups[g].comp_size;
+        }
+    }
+
+    // Sizes of the buffers in a blob, to size the spans passed to decompress()
+    static std::vector<uint64_t> sizes(const std::vector<uint8_t>& blob) {
+        ByteReader r(blob.data(), blob.size());
+        uint64_t count = r.get_u64();
+        if (count > r.remaining() / sizeof(uint64_t)) throw std::runtime_error("Corrupted batch header");
+        std::vector<uint64_t> result(count);
+        for (auto& n : result) n = r.get_u64();
+        return result;
+    }
+
+    void decompress(const std::vector<uint8_t>& blob, const std::vector<MutableSpan>& out) {
+        ByteReader r(blob.data(), blob.size());
+        if (r.get_u64() != out.size()) throw std::runtime_error("Batch holds a different number of buffers");
+        for (const auto& span : out)
+            if (r.get_u64() != span.size) throw std::runtime_error("Batch buffer size mismatch");
+        uint64_t group_count = r.get_u64();
+        if (group_count > r.remaining() / (4 * sizeof(uint64_t))) throw std::runtime_error("Corrupted batch header");
+        std::vector<Group> groups(group_count);
+        // Groups must cover the buffers in order, each exactly once, before any
+        // worker copies out of a frame
+        uint64_t next = 0;
+        for (auto& grp : groups) {
+            grp.first = r.get_u64();
+            grp.buffers = r.get_u64();
+            grp.raw_size = r.get_u64();
+            grp.comp_size = r.get_u64();
+            if (grp.first != next || grp.buffers > out.size() - next)
+                throw std::runtime_error("Corrupted batch header");
+            uint64_t raw_size = 0;
+            for (uint64_t i = grp.first; i < grp.first + grp.buffers; ++i) raw_size += out[i].size;
+            if (raw_size != grp.raw_size || raw_size % 2 != 0) throw std::runtime_error("Corrupted batch header");
+            next += grp.buffers;
         }
-        if (chunks_in_batch == 0) break;
+        if (next != out.size()) throw std::runtime_error("Corrupted batch header");
+        std::vector<const uint8_t*> frames;
+        for (const auto& grp : groups) frames.push_back(r.sub(grp.comp_size).position());
+        ensure_workers();
 
-        // B. Process Batch (Parallel)
+        std::string error;
         #pragma omp parallel for schedule(dynamic)
-        for (int i = 0; i < chunks_in_batch; ++i) {
-            Chunk& c = batch[i];
-            
-            if (c.raw_data.size() < c.raw_size) c.raw_data.resize(c.raw_size);
-            if (c.scratch_buffer.size() < c.raw_size) c.scratch_buffer.resize(c.raw_size);
+        for (size_t g = 0; g < groups.size(); ++g) {
+            Worker& w = *workers[omp_get_thread_num()];
+            const Group& grp = groups[g];
+            grow(w.packed, grp.raw_size);
+            grow(w.shuffled, grp.raw_size);
+            size_t n = ZSTD_decompressDCtx(w.dctx, w.shuffled.data(), grp.raw_size, frames[g], grp.comp_size);
+            if (ZSTD_isError(n) || n != grp.raw_size) {
+                #pragma omp critical(batch_error)
+                {
+                    if (error.empty()) error = "Corrupted batch frame";
+                }
+                continue;
+            }
+            unshuffle_bf16(w.shuffled.data(), w.packed.data(), grp.raw_size);
+            size_t pos = 0;
+            for (uint64_t i = grp.first; i < grp.first + grp.buffers; ++i) {
+                std::memcpy(out[i].data, w.packed.data() + pos, out[i].size);
+                pos += out[i].size;
+            }
+        }
+        if (!error.empty()) throw std::runtime_error(error);
+    }
+};
 
-            ZSTD_DCtx* dctx = ZSTD_createDCtx();
-            size_t d_size = ZSTD_decompressDCtx(dctx, 
-                                                c.scratch_buffer.data(), c.raw_size, 
-                                                c.comp_data.data(), c.comp_size);
-            
-            if (ZSTD_isError(d_size)) {
-                std::cerr << "ZSTD Decompress Error: " << ZSTD_getErrorName(d_size) << std::endl;
-                exit(1);
+// Buffers/s of the batch API at 4KB-1MB buffers, using the tensor data of a
+// safetensors file as payload
+void bench_batch(const std::string& input_path, const std::string& csv_path, int level) {
+    std::ifstream input(input_path, std::ios::binary);
+    if (!input) throw std::runtime_error("Cannot open input: " + input_path);
+    uint64_t header_size = 0;
+    if (!read_uint64(input, header_size)) throw std::runtime_error("Empty file or missing size");
+    input.seekg(header_size, std::ios::cur);
+    std::vector<uint8_t> data(64 * 1024 * 1024);
+    input.read(reinterpret_cast<char*>(data.data()), data.size());
+    data.resize(static_cast<size_t>(input.gcount()) & ~size_t(1));
+
+    std::ofstream csv(csv_path);
+    if (!csv) throw std::runtime_error("Cannot open output: " + csv_path);
+    csv << "buffer_kb,buffers,threads,level,ratio,compress_buffers_per_s,decompress_buffers_per_s,"
+           "compress_mb_s,decompress_mb_s\n";
+
+    BatchCodec codec(level);
+    std::vector<uint8_t> blob;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << " buffer_kb  buffers   ratio  comp_buf/s  decomp_buf/s  comp_MB/s  decomp_MB/s" << std::endl;
+    for (size_t size : {4096, 16384, 65536, 262144, 1048576}) {
+        size_t count = std::min<size_t>(4096, data.size() / size);
+        if (count == 0) continue;
+        std::vector<ConstSpan> in;
+        for (size_t i = 0; i < count; ++i) in.push_back({data.data() + i * size, size});
+        std::vector<uint8_t> restored(count * size);
+        std::vector<MutableSpan> out;
+        for (size_t i = 0; i < count; ++i) out.push_back({restored.data() + i * size, size});
+
+        // Repeat each direction for at least a second, after one warm-up call
+        codec.compress(in, blob);
+        Timer ct;
+        int c_reps = 0;
+        do {
+            codec.compress(in, blob);
+            c_reps++;
+        } while (ct.elapsed() < 1.0);
+        double c_secs = ct.elapsed();
+
+        codec.decompress(blob, out);
+        Timer dt;
+        int d_reps = 0;
+        do {
+            codec.decompress(blob, out);
+            d_reps++;
+        } while (dt.elapsed() < 1.0);
+        double d_secs = dt.elapsed();
+        if (std::memcmp(restored.data(), data.data(), restored.size()) != 0)
+            throw std::runtime_error("Batch round trip mismatch");
+
+        double mb = count * size / 1e6;
+        double ratio = static_cast<double>(count * size) / blob.size();
+        double c_bps = count * c_reps / c_secs, d_bps = count * d_reps / d_secs;
+        std::cout << std::setw(10) << size / 1024 << std::setw(9) << count << std::setw(8) << ratio
+                  << std::setw(12) << c_bps << std::setw(14) << d_bps << std::setw(11) << mb * c_reps / c_secs
+                  << std::setw(13) << mb * d_reps / d_secs << std::endl;
+        csv << size / 1024 << "," << count << "," << omp_get_max_threads() << "," << level << "," << ratio << ","
+            << c_bps << "," << d_bps << "," << mb * c_reps / c_secs << "," << mb * d_reps / d_secs << "\n";
+    }
+}
+
+// --- Random-Access Benchmark ---
+// Latency of single fetches through ArchiveReader, the path lazy loaders take:
+// whole random tensors and random row slices of 2D tensors. The input is
+// compressed once per layout (chunk size, with and without packed small
+// tensors) into a scratch archive next to the CSV, then every access kind is
+// timed per thread count, with the archive in the page cache (warm) and evicted
+// before every fetch (cold).
+constexpr size_t ACCESS_OPS = 1000;          // Fetches per configuration, enough for a p999
+constexpr double ACCESS_TIME_LIMIT = 10.0;   // Seconds per configuration before it stops early
+
+struct AccessResult {
+    size_t ops = 0;
+    uint64_t bytes = 0;
+    double seconds = 0.0;
+    std::vector<double> latencies; // Milliseconds, sorted
+};
+
+double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+// Runs ACCESS_OPS fetches over `threads` threads. rows == 0 fetches whole
+// tensors, otherwise `rows` consecutive rows of a random 2D tensor. Seeds are
+// fixed so every layout sees the same request sequence.
+AccessResult time_access(const ArchiveReader& reader, int fd, const std::vector<const TensorInfo*>& targets,
+                         uint64_t rows, int threads, bool cold) {
+    AccessResult result;
+    std::vector<std::vector<double>> latencies(threads);
+    std::atomic<uint64_t> bytes(0);
+    std::mutex error_mutex;
+    std::string error;
+    Timer timer;
+    std::vector<std::thread> workers;
+    for (int w = 0; w < threads; ++w) {
+        workers.emplace_back([&, w]() {
+            try {
+                std::mt19937_64 rng(0x5eed + w);
+                std::vector<uint8_t> buffer;
+                for (size_t op = w; op < ACCESS_OPS && timer.elapsed() < ACCESS_TIME_LIMIT; op += threads) {
+                    const TensorInfo& t = *targets[rng() % targets.size()];
+                    uint64_t offset = t.begin, size = t.end - t.begin;
+                    if (rows) {
+                        uint64_t row_bytes = size / t.shape[0];
+                        offset += rng() % (t.shape[0] - rows + 1) * row_bytes;
+                        size = rows * row_bytes;
+                    }
+                    if (buffer.size() < size) buffer.resize(size);
+                    if (cold) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                    Timer op_timer;
+                    reader.read_range(offset, size, buffer.data());
+                    latencies[w].push_back(op_timer.elapsed() * 1000.0);
+                    bytes += size;
+                }
+            } catch (const std::exception& e) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (error.empty()) error = e.what();
             }
-            ZSTD_freeDCtx(dctx);
+        });
+    }
+    for (auto& t : workers) t.join();
+    if (!error.empty()) throw std::runtime_error(error);
+    result.seconds = timer.elapsed();
+    for (const auto& l : latencies) result.latencies.insert(result.latencies.end(), l.begin(), l.end());
+    std::sort(result.latencies.begin(), result.latencies.end());
+    result.ops = result.latencies.size();
+    result.bytes = bytes;
+    return result;
+}
+
+void bench_access(const std::string& input_path, const std::string& csv_path, int level) {
+    std::ofstream csv(csv_path);
+    if (!csv) throw std::runtime_error("Cannot open output: " + csv_path);
+    csv << "chunk_kb,packed,frames,archive_mb,access,slice_rows,threads,cache,ops,p50_ms,p99_ms,p999_ms,max_ms,"
+           "mean_ms,mb_s\n";
+
+    std::vector<int> thread_counts = {1};
+    if (omp_get_max_threads() > 1) thread_counts.push_back(omp_get_max_threads());
+    std::string archive_path = csv_path + ".access.tmp";
+    std::vector<uint8_t> warm_buffer(CHUNK_SIZE);
+
+    std::cout << std::fixed << std::setprecision(3);
+    for (uint64_t chunk_size : {uint64_t(1) << 20, uint64_t(4) << 20, uint64_t(CHUNK_SIZE)}) {
+        for (bool packed : {false, true}) {
+            CompressOptions opts;
+            opts.level = level;
+            opts.chunk_size = chunk_size;
+            opts.pack_small = packed;
+            opts.quiet = true;
+            compress(input_path, archive_path, opts);
+
+            // Dirty pages survive POSIX_FADV_DONTNEED, so flush the fresh archive first
+            int fd = ::open(archive_path.c_str(), O_RDONLY);
+            if (fd < 0) throw std::runtime_error("Cannot open input: " + archive_path);
+            fdatasync(fd);
+            struct stat sb;
+            fstat(fd, &sb);
+            try {
+                ArchiveReader reader(archive_path);
+                std::vector<const TensorInfo*> tensors, matrices;
+                for (const auto& t : reader.layout().tensors) {
+                    if (t.end == t.begin) continue;
+                    tensors.push_back(&t);
+                    if (t.shape.size() == 2 && t.shape[0] > 0) matrices.push_back(&t);
+                }
+
+                std::cout << "\n" << chunk_size / 1024 << "KB chunks" << (packed ? ", small tensors packed" : "")
+                          << ": " << reader.chunks().size() << " frames" << std::endl;
+                std::cout << "  access      threads  cache    ops     p50_ms     p99_ms    p999_ms     max_ms" << std::endl;
+                for (uint64_t rows : {uint64_t(0), uint64_t(1), uint64_t(64)}) {
+                    std::vector<const TensorInfo*> targets;
+                    for (const TensorInfo* t : rows ? matrices : tensors)
+                        if (!rows || t->shape[0] >= rows) targets.push_back(t);
+                    if (targets.empty()) continue;
+                    std::string access = rows ? "rows" : "tensor";
+                    for (int threads : thread_counts) {
+                        for (bool cold : {false, true}) {
+                            if (!cold) {
+                                for (uint64_t pos = 0; pos < static_cast<uint64_t>(sb.st_size); pos += warm_buffer.size())
+                                    if (::pread(fd, warm_buffer.data(), warm_buffer.size(), pos) <= 0) break;
+                            }
+                            AccessResult r = time_access(reader, fd, targets, rows, threads, cold);
+                            double mean = 0.0;
+                            for (double l : r.latencies) mean += l;
+                            mean /= std::max<size_t>(r.ops, 1);
+                            std::string label = rows ? access + " x" + std::to_string(rows) : access;
+                            std::cout << "  " << std::left << std::setw(12) << label << std::right << std::setw(7)
+                                      << threads << std::setw(7) << (cold ? "cold" : "warm") << std::setw(7) << r.ops
+                                      << std::setw(11) << percentile(r.latencies, 0.5) << std::setw(11)
+                                      << percentile(r.latencies, 0.99) << std::setw(11)
+                                      << percentile(r.latencies, 0.999) << std::setw(11)
+                                      << (r.latencies.empty() ? 0.0 : r.latencies.back()) << std::endl;
+                            csv << chunk_size / 1024 << "," << (packed ? 1 : 0) << "," << reader.chunks().size() << ","
+                                << sb.st_size / 1e6 << "," << access << "," << rows << "," << threads << ","
+                                << (cold ? "cold" : "warm") << "," << r.ops << "," << percentile(r.latencies, 0.5)
+                                << "," << percentile(r.latencies, 0.99) << "," << percentile(r.latencies, 0.999)
+                                << "," << (r.latencies.empty() ? 0.0 : r.latencies.back()) << "," << mean << ","
+                                << r.bytes / 1e6 / std::max(r.seconds, 1e-9) << "\n";
+                        }
+                    }
+                }
+            } catch (...) {
+                ::close(fd);
+                std::remove(archive_path.c_str());
+                throw;
+            }
+            ::close(fd);
+            std::remove(archive_path.c_str());
+        }
+    }
+    std::cout << "\nResults written to " << csv_path << std::endl;
+}
+
+// --- Resource Limits ---
+// In a container omp_get_max_threads() reports the host, not the pod. Default
+// thread and batch counts come from the CPU affinity mask and the cgroup CPU
+// and memory limits instead (cgroup v2, with v1 as fallback).
+struct ResourceLimits {
+    int affinity_cpus = 1;
+    double cpu_quota = 0.0;    // CPUs, 0 = unlimited
+    uint64_t memory_limit = 0; // Bytes, 0 = unlimited
+
+    int threads() const {
+        int n = affinity_cpus;
+        if (cpu_quota > 0.0) n = std::min(n, std::max(1, static_cast<int>(cpu_quota)));
+        return std::max(1, n);
+    }
+
+    // Chunks in flight that fit in half the memory limit, at ~3 chunk-sized buffers each
+    int chunk_slots() const {
+        if (memory_limit == 0) return INT_MAX;
+        return static_cast<int>(std::max<uint64_t>(1, memory_limit / 2 / (3 * CHUNK_SIZE)));
+    }
+};
+
+std::string read_first_line(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+// Path of this process in the hierarchy of a v1 controller, or the v2 one when empty
+std::string cgroup_path(const std::string& controller) {
+    std::ifstream in("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t a = line.find(':'), b = line.find(':', a + 1);
+        if (a == std::string::npos || b == std::string::npos) continue;
+        std::string controllers = "," + line.substr(a + 1, b - a - 1) + ",";
+        bool match = controller.empty() ? controllers == ",," : controllers.find("," + controller + ",") != std::string::npos;
+        if (match) return line.substr(b + 1);
+    }
+    return "/";
+}
+
+// Directories from the process's cgroup up to the root of a mounted hierarchy;
+// a limit set on any of them applies
+std::vector<std::string> cgroup_dirs(const std::string& mount, std::string path) {
+    std::vector<std::string> dirs;
+    while (!path.empty() && path != "/") {
+        dirs.push_back(mount + path);
+        path = path.substr(0, path.rfind('/'));
+    }
+    dirs.push_back(mount);
+    return dirs;
+}
+
+ResourceLimits detect_resource_limits() {
+    ResourceLimits l;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    l.affinity_cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : omp_get_num_procs();
 
-            unshuffle_bf16(c.scratch_buffer.data(), c.raw_data.data(), c.raw_size);
+    auto tighter = [](double current, double limit) { return current == 0.0 ? limit : std::min(current, limit); };
+    struct stat st;
+    if (::stat("/sys/fs/cgroup/cgroup.controllers", &st) == 0) {
+        for (const auto& dir : cgroup_dirs("/sys/fs/cgroup", cgroup_path(""))) {
+            std::string cpu = read_first_line(dir + "/cpu.max");   // "<quota> <period>" or "max <period>"
+            if (!cpu.empty() && cpu.compare(0, 3, "max") != 0) {
+                double quota = std::stod(cpu), period = std::stod(cpu.substr(cpu.find(' ') + 1));
+                if (period > 0) l.cpu_quota = tighter(l.cpu_quota, quota / period);
+            }
+            std::string mem = read_first_line(dir + "/memory.max");
+            if (!mem.empty() && mem != "max")
+                l.memory_limit = l.memory_limit ? std::min<uint64_t>(l.memory_limit, std::stoull(mem)) : std::stoull(mem);
         }
+        return l;
+    }
+    for (const auto& dir : cgroup_dirs("/sys/fs/cgroup/cpu", cgroup_path("cpu"))) {
+        std::string quota = read_first_line(dir + "/cpu.cfs_quota_us");
+        std::string period = read_first_line(dir + "/cpu.cfs_period_us");
+        if (!quota.empty() && !period.empty() && std::stoll(quota) > 0 && std::stoll(period) > 0)
+            l.cpu_quota = tighter(l.cpu_quota, static_cast<double>(std::stoll(quota)) / std::stoll(period));
+    }
+    for (const auto& dir : cgroup_dirs("/sys/fs/cgroup/memory", cgroup_path("memory"))) {
+        std::string mem = read_first_line(dir + "/memory.limit_in_bytes");
+        if (mem.empty()) continue;
+        uint64_t limit = std::stoull(mem);
+        if (limit < (uint64_t(1) << 60)) l.memory_limit = l.memory_limit ? std::min(l.memory_limit, limit) : limit;
+    }
+    return l;
+}
+
+// Parses "PATTERN=BITS" for --mantissa-bits-for
+std::pair<std::string, int> parse_mantissa_override(const std::string& arg) {
+    size_t eq = arg.rfind('=');
+    if (eq == std::string::npos || eq == 0) throw std::runtime_error("Expected PATTERN=BITS, got: " + arg);
+    return {arg.substr(0, eq), std::stoi(arg.substr(eq + 1))};
+}
 
-        // C. Write Batch (Serial)
-        for (int i = 0; i < chunks_in_batch; ++i) {
-            output.write(reinterpret_cast<const char*>(batch[i].raw_data.data()), batch[i].raw_size);
+// Parses a comma-separated list of levels and FIRST:LAST ranges, e.g. "-7:-1,1,3:5".
+// Ranges skip 0 (zstd's "default"); a single 0 is rejected.
+std::vector<int> parse_level_list(const std::string& arg) {
+    std::vector<int> levels;
+    size_t start = 0;
+    while (start <= arg.size()) {
+        size_t comma = arg.find(',', start);
+        std::string item = arg.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        size_t colon = item.find(':', 1);
+        int first = std::stoi(item.substr(0, colon));
+        int last = (colon == std::string::npos) ? first : std::stoi(item.substr(colon + 1));
+        if (first > last) throw std::runtime_error("Empty level range: " + item);
+        for (int l = first; l <= last; ++l) {
+            // 0 means "default" to zstd: a range steps over it, a single level may not name it
+            if (l == 0 && first != last) continue;
+            if (l < ZSTD_minCLevel() || l > ZSTD_maxCLevel() || l == 0)
+                throw std::runtime_error("Invalid compression level: " + std::to_string(l));
+            levels.push_back(l);
         }
-        print_progress(input.tellg(), total_input_size);
+        if (comma == std::string::npos) break;
+        start = comma + 1;
     }
-    
-    std::cout << "\nDone in " << timer.elapsed() << "s" << std::endl;
+    return levels;
+}
+
+void check_mantissa_bits(int bits) {
+    if (bits < 0 || bits > BF16_MANTISSA_BITS)
+        throw std::runtime_error("Mantissa bits must be between 0 and " + std::to_string(BF16_MANTISSA_BITS));
 }
 
 int main(int argc, char** argv) {
     if (argc < 4) {
-        std::cerr << "Usage: " << argv[0] << " <compress|decompress> <input> <output> [level]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <compress|decompress|extract> <input> <output> [level] [options]" << std::endl;
+        std::cerr << "       (compress also takes PyTorch .bin/.pt zip checkpoints, restored byte for byte)" << std::endl;
+        std::cerr << "       " << argv[0] << " load <archive> <output.safetensors> [options]" << std::endl;
+        std::cerr << "       " << argv[0] << " watch <dir> <output_dir> [level] [options]" << std::endl;
+        std::cerr << "       " << argv[0] << " bench-batch <model.safetensors> <results.csv> [level]" << std::endl;
+        std::cerr << "       " << argv[0] << " bench-access <model.safetensors> <results.csv> [level]" << std::endl;
+        std::cerr << "       (fetch latency percentiles per chunk size, packing, threads and page cache state)" << std::endl;
+        std::cerr << "Compression options:" << std::endl;
+        std::cerr << "  --mantissa-bits K            Lossy: round BF16 mantissas to K bits (0-7, default 7 = lossless)" << std::endl;
+        std::cerr << "  --mantissa-bits-for PAT=K    Override K for tensors whose name matches the glob PAT" << std::endl;
+        std::cerr << "  --downcast-f32               Store F32 tensors as BF16 (round-to-nearest-even)" << std::endl;
+        std::cerr << "  --permute-rows               Sort rows of 2D BF16 tensors by exponent (lossless)" << std::endl;
+        std::cerr << "  --follow                     Input is still being written: compress chunks as they land" << std::endl;
+        std::cerr << "  --follow-timeout SEC         With --follow: give up when the input stops growing (default 60)" << std::endl;
+        std::cerr << "  --progressive                Store all exponent planes first; mantissas follow in" << std::endl;
+        std::cerr << "                               separate frames (enables --approximate restores)" << std::endl;
+        std::cerr << "  --schedule file|lpt          Chunk dispatch order: file order (default) or longest" << std::endl;
+        std::cerr << "                               predicted compression time first, from a sample probe" << std::endl;
+        std::cerr << "  --background                 Idle CPU and I/O priority; park workers under CPU/I/O" << std::endl;
+        std::cerr << "                               pressure (PSI) so co-located jobs keep their speed" << std::endl;
+        std::cerr << "  --tensor-chunks              Start a new chunk at each tensor that would straddle one" << std::endl;
+        std::cerr << "  --chunk-kb N                 Chunk (frame) size in KB, 64 to " << CHUNK_SIZE / 1024
+                  << " (default); smaller" << std::endl;
+        std::cerr << "                               chunks decode faster on random reads, compress a bit worse" << std::endl;
+        std::cerr << "  --pack-small                 Own chunks for large tensors; tensors under "
+                  << PACK_TENSOR_LIMIT / 1024 << "KB share" << std::endl;
+        std::cerr << "                               frames per dtype, for cheap random access (lossless only)" << std::endl;
+        std::cerr << "  --verify                     Decode every fresh frame in its worker and compare it with" << std::endl;
+        std::cerr << "                               its input before it is written (no extra I/O)" << std::endl;
+        std::cerr << "  --reuse PREV                 Copy frames of unchanged chunks from archive PREV" << std::endl;
+        std::cerr << "                               (implies --tensor-chunks; single level only)" << std::endl;
+        std::cerr << "  --levels LIST                Level sweep in one pass, e.g. 1,3,5 or -7:22; the output" << std::endl;
+        std::cerr << "                               path may contain {level}, otherwise .<level> is appended" << std::endl;
+        std::cerr << "  --sizes-only                 With --levels: only report sizes and times" << std::endl;
+        std::cerr << "  --levels-csv FILE            With --levels: write per-level results as CSV" << std::endl;
+        std::cerr << "Decompression options:" << std::endl;
+        std::cerr << "  --tensor-times               Report when each tensor became available" << std::endl;
+        std::cerr << "  --tensor-times-csv FILE      Also write per-tensor ready times as CSV" << std::endl;
+        std::cerr << "  --load-order FILE            Tensor names in load order (default: header order)" << std::endl;
+        std::cerr << "  --prioritize-load-order      Decode chunks so tensors complete in load order" << std::endl;
+        std::cerr << "  --approximate zero|mid       Progressive archives: restore BF16/F32 from exponents only" << std::endl;
+        std::cerr << "                               (chunks with other dtypes are decoded in full)" << std::endl;
+        std::cerr << "  --patch                      Progressive archives: write full mantissas in place, over" << std::endl;
+        std::cerr << "                               the approximate output or right after --approximate" << std::endl;
+        std::cerr << "  --mmap-input                 Decode frames in place from the mapped archive" << std::endl;
+        std::cerr << "  --mmap-output                Decode straight into the preallocated, mapped output file" << std::endl;
+        std::cerr << "  --non-temporal               With --mmap-output: store past the cache (x86 SSE2)" << std::endl;
+        std::cerr << "  --batch N                    Chunks read ahead and decoded per batch (default " << BATCH_SIZE << ")" << std::endl;
+        std::cerr << "Watch options (also takes the compression options):" << std::endl;
+        std::cerr << "  --jobs N                     Files compressed at once, sharing the threads (default 1)" << std::endl;
+        std::cerr << "Extraction options:" << std::endl;
+        std::cerr << "  --tensor PAT                 Extract tensors whose name matches the glob PAT (repeatable)" << std::endl;
+        std::cerr << "Load options (lazy loader, one tensor at a time; also --tensor and --load-order):" << std::endl;
+        std::cerr << "  --prefetch K                 Decode the next K predicted tensors ahead (default 4, 0 = off)" << std::endl;
+        std::cerr << "Storage emulation (benchmarking, compress/decompress):" << std::endl;
+        std::cerr << "  --throttle-mbps MB           Limit input and output to MB/s (token bucket)" << std::endl;
+        std::cerr << "  --throttle-latency-ms MS     Add MS of latency to every I/O request" << std::endl;
+        std::cerr << "  --throttle-burst-mb MB       Token bucket capacity (default 4)" << std::endl;
+        std::cerr << "  --throttle-in-memory         Load the input into RAM first and serve it from there" << std::endl;
         return 1;
     }
 
     std::string mode = argv[1];
     std::string input = argv[2];
     std::string output = argv[3];
-    int level = (argc >= 5) ? std::stoi(argv[4]) : DEFAULT_COMPRESSION_LEVEL;
 
     try {
-        if (mode == "compress") compress(input, output, level);
-        else if (mode == "decompress") decompress(input, output);
+        CompressOptions opts;
+        DecompressOptions dopts;
+        std::vector<std::string> tensor_patterns;
+        int jobs = 1;
+        int prefetch = 4;
+        bool batch_given = false;
+        int arg = 4;
+        if (arg < argc && std::string(argv[arg]).rfind("--", 0) != 0) opts.level = std::stoi(argv[arg++]);
+        for (; arg < argc; ++arg) {
+            std::string flag = argv[arg];
+            auto value = [&]() -> std::string {
+                if (arg + 1 >= argc) throw std::runtime_error("Missing value for " + flag);
+                return argv[++arg];
+            };
+            if (flag == "--mantissa-bits") {
+                opts.mantissa_bits = std::stoi(value());
+                check_mantissa_bits(opts.mantissa_bits);
+            } else if (flag == "--mantissa-bits-for") {
+                opts.mantissa_overrides.push_back(parse_mantissa_override(value()));
+                check_mantissa_bits(opts.mantissa_overrides.back().second);
+            } else if (flag == "--downcast-f32") {
+                opts.downcast_f32 = true;
+            } else if (flag == "--permute-rows") {
+                opts.permute_rows = true;
+            } else if (flag == "--levels") {
+                opts.levels = parse_level_list(value());
+            } else if (flag == "--follow") {
+                opts.follow = true;
+            } else if (flag == "--follow-timeout") {
+                opts.follow = true;
+                opts.follow_timeout = std::stod(value());
+            } else if (flag == "--progressive") {
+                opts.progressive = true;
+            } else if (flag == "--approximate") {
+                dopts.approximate = value();
+            } else if (flag == "--mmap-input") {
+                dopts.mmap_input = true;
+            } else if (flag == "--mmap-output") {
+                dopts.mmap_output = true;
+            } else if (flag == "--non-temporal") {
+                dopts.mmap_output = true;
+                dopts.non_temporal = true;
+            } else if (flag == "--patch") {
+                dopts.patch = true;
+            } else if (flag == "--background") {
+                opts.background = true;
+            } else if (flag == "--schedule") {
+                std::string order = value();
+                if (order != "file" && order != "lpt") throw std::runtime_error("--schedule takes file or lpt");
+                opts.schedule_lpt = order == "lpt";
+            } else if (flag == "--tensor-chunks") {
+                opts.tensor_chunks = true;
+            } else if (flag == "--verify") {
+                opts.verify = true;
+            } else if (flag == "--chunk-kb") {
+                opts.chunk_size = std::stoull(value()) * 1024;
+                if (opts.chunk_size < 64 * 1024 || opts.chunk_size > CHUNK_SIZE)
+                    throw std::runtime_error("--chunk-kb must be between 64 and " + std::to_string(CHUNK_SIZE / 1024));
+            } else if (flag == "--pack-small") {
+                opts.pack_small = true;
+            } else if (flag == "--reuse") {
+                opts.reuse_path = value();
+                opts.tensor_chunks = true;
+            } else if (flag == "--sizes-only") {
+                opts.sizes_only = true;
+            } else if (flag == "--levels-csv") {
+                opts.levels_csv = value();
+            } else if (flag == "--throttle-mbps") {
+                opts.throttle.bandwidth_mbps = dopts.throttle.bandwidth_mbps = std::stod(value());
+            } else if (flag == "--throttle-latency-ms") {
+                opts.throttle.latency_ms = dopts.throttle.latency_ms = std::stod(value());
+            } else if (flag == "--throttle-burst-mb") {
+                opts.throttle.burst_mb = dopts.throttle.burst_mb = std::stod(value());
+            } else if (flag == "--throttle-in-memory") {
+                opts.throttle.in_memory = dopts.throttle.in_memory = true;
+            } else if (flag == "--batch") {
+                dopts.batch_size = std::stoi(value());
+                batch_given = true;
+            } else if (flag == "--jobs") {
+                jobs = std::stoi(value());
+                if (jobs < 1) throw std::runtime_error("--jobs must be at least 1");
+            } else if (flag == "--prefetch") {
+                prefetch = std::stoi(value());
+                if (prefetch < 0) throw std::runtime_error("--prefetch must not be negative");
+            } else if (flag == "--tensor") {
+                tensor_patterns.push_back(value());
+            } else if (flag == "--tensor-times") {
+                dopts.tensor_times = true;
+            } else if (flag == "--tensor-times-csv") {
+                dopts.tensor_times = true;
+                dopts.tensor_times_csv = value();
+            } else if (flag == "--load-order") {
+                dopts.load_order_path = value();
+            } else if (flag == "--prioritize-load-order") {
+                dopts.prioritize = true;
+            } else {
+                throw std::runtime_error("Unknown option: " + flag);
+            }
+        }
+
+        // Size the defaults to what the container actually grants
+        ResourceLimits limits = detect_resource_limits();
+        bool threads_given = std::getenv("OMP_NUM_THREADS") != nullptr;
+        if (!threads_given) omp_set_num_threads(std::min(limits.threads(), limits.chunk_slots()));
+        if (!batch_given) dopts.batch_size = std::min(BATCH_SIZE, limits.chunk_slots());
+        std::cout << "Limits: " << limits.affinity_cpus << " CPUs in affinity mask, CPU quota ";
+        if (limits.cpu_quota > 0.0) std::cout << limits.cpu_quota; else std::cout << "none";
+        std::cout << ", memory limit ";
+        if (limits.memory_limit) std::cout << limits.memory_limit / (1024 * 1024) << " MB"; else std::cout << "none";
+        std::cout << " -> " << omp_get_max_threads() << " threads" << (threads_given ? " (OMP_NUM_THREADS)" : "");
+        if (mode == "decompress") std::cout << ", batch " << dopts.batch_size;
+        std::cout << std::endl;
+
+        if (mode == "compress") compress(input, output, opts);
+        else if (mode == "decompress") decompress(input, output, dopts);
+        else if (mode == "extract") extract(input, output, tensor_patterns);
+        else if (mode == "load") load(input, output, tensor_patterns, dopts.load_order_path, prefetch);
+        else if (mode == "watch") watch(input, output, opts, jobs);
+        else if (mode == "bench-batch") bench_batch(input, output, opts.level);
+        else if (mode == "bench-access") bench_access(input, output, opts.level);
         else std::cerr << "Unknown mode: " << mode << std::endl;
     } catch (const std::exception& e) {
         std::cerr << "\nError: " << e.what() << std::endl;
@@ -60,6 +60,82 @@ bool read_uint64(std::ifstream& in, uint64_t& value) {
     return in.gcount() == sizeof(value);
 }
 
+// --- Container Footer ---
+// bf16_omp appends a footer of tagged sections after the chunk records:
+//   [u64 tag][u64 length][payload]... [u64 footer_size][u64 FOOTER_MAGIC]
+// Its chunk index gives the place of every record in the data region, since
+// records may be written out of order. Sections that change what a frame holds
+// (lossy rounding, row permutation, progressive or packed frames, non-safetensors
+// input) are rejected before any output is written.
+constexpr uint64_t FOOTER_MAGIC = 0x5846363142465A31ULL; // "1ZFB16FX"
+constexpr uint64_t SECTION_CHUNK_BITS = 2;
+constexpr uint64_t SECTION_CHUNK_INDEX = 4;
+constexpr uint64_t SECTION_CHUNK_HASH = 5;
+
+struct ChunkRecord {
+    uint64_t file_offset = 0; // Start of the [raw_size][comp_size][frame] record
+    uint64_t data_offset = 0; // Position in the tensor data region
+    uint64_t raw_size = 0;
+    uint64_t comp_size = 0;
+};
+
+// Reads the footer if present, fills `index` from it and returns the file offset
+// where the chunk records end
+uint64_t read_footer(std::ifstream& in, uint64_t file_size, std::vector<ChunkRecord>& index) {
+    if (file_size < 2 * sizeof(uint64_t)) return file_size;
+    std::streampos current = in.tellg();
+    uint64_t footer_size = 0, magic = 0;
+    in.seekg(file_size - 2 * sizeof(uint64_t), std::ios::beg);
+    if (!read_uint64(in, footer_size) || !read_uint64(in, magic) || magic != FOOTER_MAGIC) {
+        in.clear();
+        in.seekg(current, std::ios::beg);
+        return file_size;
+    }
+    if (footer_size > file_size - 2 * sizeof(uint64_t)) throw std::runtime_error("Corrupted footer");
+
+    uint64_t footer_start = file_size - 2 * sizeof(uint64_t) - footer_size;
+    std::vector<uint8_t> bytes(footer_size);
+    in.seekg(footer_start, std::ios::beg);
+    in.read(reinterpret_cast<char*>(bytes.data()), footer_size);
+    if (in.gcount() != static_cast<std::streamsize>(footer_size)) throw std::runtime_error("Truncated footer");
+    in.seekg(current, std::ios::beg);
+
+    uint64_t pos = 0;
+    auto get_u64 = [&](uint64_t end) {
+        if (end - pos < sizeof(uint64_t)) throw std::runtime_error("Corrupted footer");
+        uint64_t value;
+        std::memcpy(&value, bytes.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return value;
+    };
+    while (pos < footer_size) {
+        uint64_t tag = get_u64(footer_size);
+        uint64_t length = get_u64(footer_size);
+        if (length > footer_size - pos) throw std::runtime_error("Corrupted footer");
+        uint64_t end = pos + length;
+        if (tag == SECTION_CHUNK_INDEX) {
+            index.resize(get_u64(end));
+            for (auto& e : index) {
+                e.file_offset = get_u64(end);
+                e.data_offset = get_u64(end);
+                e.raw_size = get_u64(end);
+                e.comp_size = get_u64(end);
+            }
+        } else if (tag == SECTION_CHUNK_BITS) {
+            // Narrowed low planes only; a table of full-width chunks changes nothing
+            uint64_t count = get_u64(end);
+            if (count > end - pos) throw std::runtime_error("Corrupted footer");
+            for (uint64_t i = 0; i < count; ++i)
+                if (bytes[pos + i] != 8) throw std::runtime_error("Archive has packed low planes; decompress it with bf16_omp");
+        } else if (tag != SECTION_CHUNK_HASH) {
+            throw std::runtime_error("Archive uses bf16_omp footer section " + std::to_string(tag) +
+                                     "; decompress it with bf16_omp");
+        }
+        pos = end;
+    }
+    return footer_start;
+}
+
 // --- Shuffle Logic (BF16 Optimization) ---
 
 void shuffle_bf16(const uint8_t* src, uint8_t* dst, size_t size) {
@@ -149,10 +225,10 @@ void compress(const std::string& input_path, const std::string& output_path, int
 void decompress(const std::string& input_path, const std::string& output_path) {
     std::ifstream input(input_path, std::ios::binary);
     if (!input) throw std::runtime_error("Cannot open input: " + input_path);
-    std::ofstream output(output_path, std::ios::binary);
-    if (!output) throw std::runtime_error("Cannot open output: " + output_path);
 
     uint64_t total_input_size = get_file_size(input);
+    std::vector<ChunkRecord> index;
+    uint64_t chunks_end = read_footer(input, total_input_size, index);
     std::cout << "Decompressing " << input_path << "..." << std::endl;
 
     // 1. Recover Header
@@ -161,7 +237,28 @@ void decompress(const std::string& input_path, const std::string& output_path) {
 
     std::vector<uint8_t> header(header_size);
     input.read(reinterpret_cast<char*>(header.data()), header_size);
-    
+    if (input.gcount() != static_cast<std::streamsize>(header_size)) throw std::runtime_error("Header truncated");
+    uint64_t data_start = sizeof(header_size) + header_size;
+
+    // Without an index the records are in file order, up to the footer
+    if (index.empty()) {
+        uint64_t pos = data_start, data_offset = 0;
+        while (pos < chunks_end) {
+            ChunkRecord e;
+            input.seekg(pos, std::ios::beg);
+            if (!read_uint64(input, e.raw_size) || !read_uint64(input, e.comp_size))
+                throw std::runtime_error("Corrupted chunk header");
+            e.file_offset = pos;
+            e.data_offset = data_offset;
+            pos += sizeof(uint64_t) * 2 + e.comp_size;
+            data_offset += e.raw_size;
+            index.push_back(e);
+        }
+    }
+
+    std::ofstream output(output_path, std::ios::binary);
+    if (!output) throw std::runtime_error("Cannot open output: " + output_path);
+
     // Write Header
     write_uint64(output, header_size);
     output.write(reinterpret_cast<const char*>(header.data()), header_size);
@@ -177,8 +274,12 @@ void decompress(const std::string& input_path, const std::string& output_path) {
     
     Timer timer;
 
-    while (read_uint64(input, chunk_raw_size)) {
-        if (!read_uint64(input, chunk_comp_size)) throw std::runtime_error("Corrupted chunk header");
+    for (const auto& e : index) {
+        input.seekg(e.file_offset, std::ios::beg);
+        if (!read_uint64(input, chunk_raw_size) || !read_uint64(input, chunk_comp_size))
+            throw std::runtime_error("Corrupted chunk header");
+        if (chunk_raw_size != e.raw_size || chunk_comp_size != e.comp_size)
+            throw std::runtime_error("Chunk index does not match the chunk records");
 
         if (comp_buf.size() < chunk_comp_size) comp_buf.resize(chunk_comp_size);
         input.read(reinterpret_cast<char*>(comp_buf.data()), chunk_comp_size);
@@ -190,9 +291,10 @@ void decompress(const std::string& input_path, const std::string& output_path) {
         if (ZSTD_isError(d_size)) throw std::runtime_error(ZSTD_getErrorName(d_size));
 
         unshuffle_bf16(shuffled_buf.data(), final_buf.data(), chunk_raw_size);
+        output.seekp(data_start + e.data_offset, std::ios::beg);
         output.write(reinterpret_cast<const char*>(final_buf.data()), chunk_raw_size);
         
-        print_progress(input.tellg(), total_input_size);
+        print_progress(e.file_offset + sizeof(uint64_t) * 2 + chunk_comp_size, total_input_size);
     }
 
     ZSTD_freeDCtx(dctx);
@@ -0,0 +1,203 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+INPUT_FILE=${1:-model.safetensors}
+LEVEL=${2:-5}
+THREADS=${3:-$(nproc)}
+OUTPUT_CSV=${4:-results_compare.csv}
+
+SERIAL_BIN="./compressor"
+OMP_BIN="./bf16_omp"
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/baselines.XXXXXX")
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+usage() {
+    cat <<EOF
+Usage: $0 [input_file] [compression_level] [threads] [output_csv]
+
+Runs our engines and every locally installed generic compressor (zstd, pzstd,
+lz4, xz, gzip, pigz) on the same input and host, skipping the missing ones, and
+records ratio, compress/decompress time, energy and peak memory in one CSV.
+
+Energy comes from the Linux powercap/RAPL package counters
+(/sys/class/powercap/intel-rapl:N) read around each run. It covers the whole
+package, including anything else running on it, and is NA when the counters are
+missing or not readable (recent kernels restrict them to root).
+
+Defaults:
+    input_file          model.safetensors
+    compression_level   5 (our engines, zstd, pzstd; the others use their usual settings)
+    threads             $(nproc) (OMP_NUM_THREADS, zstd -T, pzstd -p, xz -T, pigz -p)
+    output_csv          results_compare.csv
+EOF
+}
+
+if [[ "${INPUT_FILE}" == "-h" || "${INPUT_FILE}" == "--help" ]]; then
+    usage
+    exit 0
+fi
+
+if [[ ! -f "${INPUT_FILE}" ]]; then
+    echo "Error: input file not found: ${INPUT_FILE}" >&2
+    usage >&2
+    exit 1
+fi
+
+echo "Building both implementations..."
+make -s all
+
+# Readable package zones; subzones (intel-rapl:N:M) are part of their package
+RAPL_ZONES=()
+for zone in /sys/class/powercap/intel-rapl:*; do
+    [[ "${zone##*/}" == intel-rapl:*:* ]] && continue
+    [[ -r "${zone}/energy_uj" && -r "${zone}/max_energy_range_uj" ]] && RAPL_ZONES+=("${zone}")
+done
+
+energy_snapshot() {
+    local zone
+    if [[ ${#RAPL_ZONES[@]} -eq 0 ]]; then return; fi
+    for zone in "${RAPL_ZONES[@]}"; do printf '%s ' "$(cat "${zone}/energy_uj")"; done
+}
+
+# Joules between two snapshots, allowing each counter to wrap once; NA without counters
+energy_joules() {
+    local ranges="" zone
+    if [[ ${#RAPL_ZONES[@]} -eq 0 ]]; then echo NA; return; fi
+    for zone in "${RAPL_ZONES[@]}"; do ranges+="$(cat "${zone}/max_energy_range_uj") "; done
+    awk -v a="$1" -v b="$2" -v r="${ranges}" 'BEGIN {
+        n = split(a, before); split(b, after); split(r, range)
+        for (i = 1; i <= n; i++) { d = after[i] - before[i]; if (d < 0) d += range[i]; total += d }
+        printf "%.1f\n", total / 1e6 }'
+}
+
+# Prints "<seconds> <peak_rss_kb> <joules>" for a shell command. Peak memory needs
+# GNU time or python3 and energy needs RAPL counters; either is NA otherwise.
+measure() {
+    local cmd="$1" e0 e1
+    e0=$(energy_snapshot)
+    measure_time "${cmd}"
+    local rc=$?
+    e1=$(energy_snapshot)
+    energy_joules "${e0}" "${e1}"
+    return "${rc}"
+}
+
+measure_time() {
+    local cmd="$1"
+    if [[ -x /usr/bin/time ]]; then
+        /usr/bin/time -f "%e %M" -o "${WORK_DIR}/stats" bash -c "${cmd}" >/dev/null 2>&1 || return
+        printf '%s ' "$(cat "${WORK_DIR}/stats")"
+    elif command -v python3 >/dev/null 2>&1; then
+        python3 -c '
+import resource, subprocess, sys, time
+start = time.monotonic()
+rc = subprocess.call(["bash", "-c", sys.argv[1]], stdin=subprocess.DEVNULL,
+                     stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+elapsed = time.monotonic() - start
+print("%.2f %d" % (elapsed, resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss), end=" ")
+sys.exit(rc)' "${cmd}"
+    else
+        local start end
+        start=$(date +%s.%N)
+        bash -c "${cmd}" >/dev/null 2>&1 || return
+        end=$(date +%s.%N)
+        awk -v s="${start}" -v e="${end}" 'BEGIN { printf "%.2f NA ", e - s }'
+    fi
+}
+
+to_mb() {
+    awk -v b="$1" 'BEGIN { printf "%.1f", b / 1000000 }'
+}
+
+kb_to_mb() {
+    if [[ "$1" == "NA" ]]; then echo "NA"; else awk -v k="$1" 'BEGIN { printf "%.1f", k / 1024 }'; fi
+}
+
+INPUT_BYTES=$(stat -c %s "${INPUT_FILE}")
+echo "compressor,input_mb,final_mb,reduction_pct,ratio,compress_s,decompress_s,compress_j,decompress_j,compress_j_per_gb,decompress_j_per_gb,compress_peak_mb,decompress_peak_mb,verified" > "${OUTPUT_CSV}"
+
+# run_one <name> <required_binary> <compress_cmd> <decompress_cmd>
+# Commands may use $IN, $ARCHIVE and $OUT, which are set per run.
+run_one() {
+    local name="$1" bin="$2" compress_cmd="$3" decompress_cmd="$4"
+
+    if ! command -v "${bin}" >/dev/null 2>&1 && [[ ! -x "${bin}" ]]; then
+        echo "Skipping ${name}: ${bin} not installed"
+        return
+    fi
+
+    export IN="${INPUT_FILE}"
+    export ARCHIVE="${WORK_DIR}/archive"
+    export OUT="${WORK_DIR}/restored"
+    rm -f "${ARCHIVE}" "${OUT}"
+
+    echo
+    echo "=== ${name} ==="
+    local c_stats d_stats
+    if ! c_stats=$(measure "${compress_cmd}"); then
+        echo "FAIL: ${name} compression failed" >&2
+        return
+    fi
+    if ! d_stats=$(measure "${decompress_cmd}"); then
+        echo "FAIL: ${name} decompression failed" >&2
+        return
+    fi
+
+    local final_bytes verified="no"
+    final_bytes=$(stat -c %s "${ARCHIVE}")
+    if cmp -s "${INPUT_FILE}" "${OUT}"; then verified="yes"; fi
+
+    local cs ck cj ds dk dj row
+    read -r cs ck cj <<< "${c_stats}"
+    read -r ds dk dj <<< "${d_stats}"
+    row=$(awk -v name="${name}" -v in_b="${INPUT_BYTES}" -v out_b="${final_bytes}" \
+              -v cs="${cs}" -v ds="${ds}" -v cj="${cj}" -v dj="${dj}" \
+              -v cm="$(kb_to_mb "${ck}")" -v dm="$(kb_to_mb "${dk}")" -v ok="${verified}" \
+              'function per_gb(j) { return j == "NA" ? "NA" : sprintf("%.1f", j / (in_b / 1e9)) }
+               BEGIN { printf "%s,%.1f,%.1f,%.1f,%.2f,%.2f,%.2f,%s,%s,%s,%s,%s,%s,%s", name, in_b / 1e6, out_b / 1e6,
+                       100 * (1 - out_b / in_b), in_b / out_b, cs, ds, cj, dj, per_gb(cj), per_gb(dj), cm, dm, ok }')
+    echo "${row}" >> "${OUTPUT_CSV}"
+    echo "$(to_mb "${final_bytes}") MB, compress ${cs}s ${cj} J, decompress ${ds}s ${dj} J, verified: ${verified}"
+}
+
+echo "Input: ${INPUT_FILE}"
+echo "Compression level: ${LEVEL}"
+echo "Threads: ${THREADS}"
+if [[ ${#RAPL_ZONES[@]} -eq 0 ]]; then
+    echo "Energy: no readable RAPL counters, reporting NA"
+else
+    echo "Energy: ${#RAPL_ZONES[@]} RAPL package zones"
+fi
+
+export OMP_NUM_THREADS="${THREADS}"
+
+run_one "serial -${LEVEL}" "${SERIAL_BIN}" \
+    "${SERIAL_BIN} compress \"\$IN\" \"\$ARCHIVE\" ${LEVEL}" \
+    "${SERIAL_BIN} decompress \"\$ARCHIVE\" \"\$OUT\""
+run_one "omp -${LEVEL}" "${OMP_BIN}" \
+    "${OMP_BIN} compress \"\$IN\" \"\$ARCHIVE\" ${LEVEL}" \
+    "${OMP_BIN} decompress \"\$ARCHIVE\" \"\$OUT\""
+run_one "zstd -${LEVEL} -T${THREADS}" zstd \
+    "zstd -q -f -${LEVEL} -T${THREADS} \"\$IN\" -o \"\$ARCHIVE\"" \
+    "zstd -q -f -d \"\$ARCHIVE\" -o \"\$OUT\""
+run_one "pzstd -${LEVEL} -p${THREADS}" pzstd \
+    "pzstd -q -f -${LEVEL} -p ${THREADS} \"\$IN\" -o \"\$ARCHIVE\"" \
+    "pzstd -q -f -d -p ${THREADS} \"\$ARCHIVE\" -o \"\$OUT\""
+run_one "lz4 -1" lz4 \
+    "lz4 -q -f -1 \"\$IN\" \"\$ARCHIVE\"" \
+    "lz4 -q -f -d \"\$ARCHIVE\" \"\$OUT\""
+run_one "lz4 -9" lz4 \
+    "lz4 -q -f -9 \"\$IN\" \"\$ARCHIVE\"" \
+    "lz4 -q -f -d \"\$ARCHIVE\" \"\$OUT\""
+run_one "gzip -9" gzip \
+    "gzip -9 -c \"\$IN\" > \"\$ARCHIVE\"" \
+    "gzip -d -c \"\$ARCHIVE\" > \"\$OUT\""
+run_one "pigz -9 -p${THREADS}" pigz \
+    "pigz -9 -p ${THREADS} -c \"\$IN\" > \"\$ARCHIVE\"" \
+    "pigz -d -p ${THREADS} -c \"\$ARCHIVE\" > \"\$OUT\""
+run_one "xz -9e -T${THREADS}" xz \
+    "xz -9e -T${THREADS} -c \"\$IN\" > \"\$ARCHIVE\"" \
+    "xz -d -T${THREADS} -c \"\$ARCHIVE\" > \"\$OUT\""
+
+echo
+echo "Results written to ${OUTPUT_CSV}"